@@ -1,9 +1,53 @@
 #include <iostream>
 #include <fstream>
-#include <Windows.h>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <climits>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory_resource>
+#include <algorithm>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_set>
+#include <unordered_map>
+#include <new>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <Windows.h>
+#include <Psapi.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(INSTRUMENT_MAPS) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #include "Stringhash.h"
 
@@ -34,15 +78,17 @@
 // The index is simply created by deviding the key by the size of the hashmap and taking
 // the modulo of the result
 //
-// To give both methods a head start, the dictionary can first be broken into 26 arrays,
-// one for each start letter of the word. This will reduce collisions between hashes.
+// To give both methods a head start, the dictionary can first be broken into shards by
+// the top bits of the hash. This will reduce collisions between hashes. Splitting on
+// the first letter instead gives very uneven shards, thousands of words for "s" and a
+// handful for "x", and doesn't work at all for words that don't start with a lower
+// case letter.
 // Just for comparison, a single monolithic associative array is added for good measure
 //
 // The test case here seems to favor a bucket size around 1/8 the size of the data set.
 // The nearest prime number to this value is chosen.
-// The main speedup comes from splitting the large data set into 26 smaller arrays, so
-// if data can be split up in a trivial way like this to begin with, then all the better
-// (ie a list of people's names could be stored as 26 tables listed by last name).
+// The main speedup comes from splitting the large data set into smaller arrays, so if
+// data can be split up in a trivial way like this to begin with, then all the better.
 // There is a 10% speedup by using the hash map so since it doesn't take any additional
 // space seems worth doing.
 //
@@ -53,8 +99,14 @@
 using namespace std;
 
 static const int    NUM_ITERATIONS = 1000000;   // number of test iterations to perform
+static const int    NUM_WARMUP_RUNS = 1;        // untimed passes before the timed trials
+static const int    NUM_TRIALS = 5;             // number of timed trials per map
+static const int    MAX_BATCH_SIZE = 32;        // largest group of words FindBatch works on at once
+static const int    BATCH_SIZES[] = { 1, 8, 16, 32 };   // batch sizes timed by RunBatchTest
 static const int    NUM_LETTERS = 26;           // number of letters in the alphabet
-static const int    NUM_TEST_CLASSES = 3;
+static const int    DEFAULT_NUM_SHARDS = 32;    // shards the sharded maps split the words into
+static const int    MAX_SHARD_BITS = 16;        // at most 1 << MAX_SHARD_BITS shards
+static const int    NUM_TEST_CLASSES = 12;
 
 static int GetNearestPrimeNumberTo(int number)
 {
@@ -95,9 +147,24 @@ static int GetNearestPrimeNumberTo(int number)
         4027, 4049, 4051, 4057, 4073, 4079, 4091, 4093
     };
 
+    // past the end of the table, search down from "number" by trial division
+    int lastIndex = sizeof(primes) / sizeof(primes[0]);
+    if (number > primes[lastIndex - 1])
+    {
+        for (int candidate = number | 1; ; candidate -= 2)
+        {
+            bool isPrime = true;
+            for (int divisor = 3; divisor <= candidate / divisor && isPrime; divisor += 2)
+            {
+                isPrime = (candidate % divisor) != 0;
+            }
+            if (isPrime && candidate <= number)
+                return candidate;
+        }
+    }
+
     // find "number" using the usual binary search. If an exact index can't be found, take the lowest
     int firstIndex = 0;
-    int lastIndex = sizeof(primes) / sizeof(primes[0]);
 
     do
     {
@@ -116,437 +183,7104 @@ static int GetNearestPrimeNumberTo(int number)
     return primes[firstIndex];
 }
 
-struct KVPair
+/////////////////////////////////////////////////////////////////////////////////////////
+// Timing
+//
+// Whole trials are timed with steady_clock. Individual lookups are far too short for
+// that, so they are timed with the CPU's timestamp counter where there is one, which
+// costs a handful of cycles to read. The counter is calibrated against steady_clock
+// once so everything can be reported in nanoseconds.
+
+#if defined(_MSC_VER)
+#define PREFETCH(address)   _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#else
+#define PREFETCH(address)   __builtin_prefetch(address)
+#endif
+
+static inline unsigned long long ReadTicks()
 {
-    unsigned int _key;
-    string       _value;
-};
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
 
-// Class describing the dictionary. It consists of an array of key-value pairs, where
-// the word (value) has been pre-hashed (key)
-// All words are stored here. The hash map classes have access to this data with which
-// to build their own data structures
-class   Dictionary
+static double GetNanosecondsPerTick()
 {
-public:
-    Dictionary()
+    static double nanosecondsPerTick = 0.0;
+    if (nanosecondsPerTick == 0.0)
     {
-        for (int loop = 0; loop < NUM_LETTERS; loop++)
+        chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+        unsigned long long startTicks = ReadTicks();
+        chrono::steady_clock::time_point endTime;
+        do
         {
-            _numWords[loop] = 0;
+            endTime = chrono::steady_clock::now();
         }
+        while (endTime - startTime < chrono::milliseconds(20));
+        unsigned long long ticks = ReadTicks() - startTicks;
+        nanosecondsPerTick = chrono::duration<double, nano>(endTime - startTime).count() / ticks;
     }
-    
-    ~Dictionary()
+    return nanosecondsPerTick;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// SIMD support
+//
+// Vector code is picked at run time from what the CPU supports rather than at compile
+// time, so one build runs everywhere. AVX2 functions are compiled for AVX2 individually.
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#endif
+
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+static SimdLevel GetSimdLevel()
+{
+#if defined(HAVE_X86_SIMD) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+#elif defined(HAVE_X86_SIMD) && defined(_MSC_VER)
+    // AVX2 also needs the OS to save the YMM registers
+    int info[4];
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6)
     {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+            return SIMD_AVX2;
     }
+    return SIMD_SSE2;
+#endif
+    return SIMD_SCALAR;
+}
 
-    // Read the dictionary, hash the key string and store in the K-V pair array
-    bool    ReadFile(char* fileName)
-    {
-        string line;
-        ifstream myfile(fileName);
+static const char* GetSimdLevelName(SimdLevel level)
+{
+    static const char* names[] = { "scalar", "sse2", "avx2" };
+    return names[level];
+}
 
-        if (myfile.is_open())
+static inline int GetLowestBit(unsigned int value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return index;
+#else
+    return __builtin_ctz(value);
+#endif
+}
+
+static inline int GetLowestBit64(unsigned long long value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return index;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+static inline int GetBitLength(unsigned long long value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse64(&index, value) ? index + 1 : 0;
+#else
+    return value ? 64 - __builtin_clzll(value) : 0;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Threads
+
+// the CPUs this process may run on, in order
+static const vector<int>& GetAvailableCpus()
+{
+    static vector<int> cpus;
+    if (cpus.empty())
+    {
+#if defined(__linux__)
+        cpu_set_t cpuSet;
+        if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0)
         {
-            while ( myfile.good() )
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
             {
-                getline( myfile, line );
-                const char* str = line.c_str();
-                if (strlen(str) > 0)
+                if (CPU_ISSET(cpu, &cpuSet))
                 {
-                    StringHash hash = StringHash( str );
-
-                    KVPair pair;
-                    pair._key = hash;
-                    pair._value = line;
-                    _stringArray.push_back(pair);
-                    
-                    int wordIndex = str[0] - 'a';
-                    _numWords[wordIndex]++;
+                    cpus.push_back(cpu);
                 }
             }
         }
-        else
+#endif
+        if (cpus.empty())
         {
-            return false;
+            int numCpus = max<int>(thread::hardware_concurrency(), 1);
+            for (int cpu = 0; cpu < numCpus; cpu++)
+            {
+                cpus.push_back(cpu);
+            }
         }
-        myfile.close();
-        return true;
-    }
-
-    const int GetWordCount(int index) const
-    {
-        return _numWords[index];
     }
+    return cpus;
+}
 
-    const int GetSize() const
-    {
-        return _stringArray.size();
-    }
+// Keep the calling thread on the "index"th available CPU, so threads don't migrate
+// between cores, and their caches, part way through a test
+static void PinThreadToCpu(int index)
+{
+    const vector<int>& cpus = GetAvailableCpus();
+    int cpu = cpus[index % cpus.size()];
+#if defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (cpu % 64));
+#elif defined(__linux__)
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+#endif
+}
 
-    const KVPair&   GetKVPair(int index) const
+// Holds threads back until all of them are ready, so their timed work starts together
+class StartGate
+{
+public:
+    StartGate(int numThreads)
+        : _numWaiting(0)
+        , _numThreads(numThreads)
+        , _open(false)
     {
-        return _stringArray[index];
     }
 
-    const string&   GetString(int index) const
+    // wait until all "numThreads" threads have called Wait
+    void    Wait()
     {
-        return _stringArray[index]._value;
+        if (++_numWaiting == _numThreads)
+        {
+            _open.store(true, memory_order_release);
+        }
+        while (!_open.load(memory_order_acquire))
+        {
+            this_thread::yield();
+        }
     }
 
 private:
-
-    // the KV pairs of words read in
-    vector<KVPair>  _stringArray;
-    int             _numWords[NUM_LETTERS];
+    atomic<int>     _numWaiting;
+    int             _numThreads;
+    atomic<bool>    _open;
 };
 
-// base class for hash map. Will handle all common functionality between the different
-// Hash map derived classes
-// It also contains a collision list of words that didn't make it into the hash map
-class   HashMapBase
+// A fixed set of worker threads that run batches of tasks. Each worker has its own
+// queue and takes tasks from its front. A worker with nothing left steals from the back
+// of another's queue, so a few big tasks don't leave the rest of the workers idle while
+// one works through them.
+class WorkStealingPool
 {
 public:
-    HashMapBase()
+    WorkStealingPool(int numThreads)
+        : _queued(0)
+        , _remaining(0)
+        , _stop(false)
     {
+        for (int loop = 0; loop < numThreads; loop++)
+        {
+            _queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+        }
+        for (int loop = 0; loop < numThreads; loop++)
+        {
+            _threads.push_back(thread(&WorkStealingPool::WorkerLoop, this, loop));
+        }
     }
 
-    virtual ~HashMapBase()
+    ~WorkStealingPool()
     {
+        {
+            lock_guard<mutex> lock(_lock);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (size_t loop = 0; loop < _threads.size(); loop++)
+        {
+            _threads[loop].join();
+        }
     }
 
-    virtual void CreateMap(Dictionary* ) = 0;
-    virtual bool Find(const string& ) const = 0;
-
-    void    RunTest(Dictionary* dictionary)
+    // Run all of "tasks" and wait for them to finish. The calling thread helps.
+    // Tasks are dealt out to the queues in order, so put the biggest first
+    void    Run(vector< function<void()> >& tasks)
     {
-        int foundCount = 0;
-        int size = dictionary->GetSize();
+        for (size_t loop = 0; loop < tasks.size(); loop++)
+        {
+            WorkQueue& queue = *_queues[loop % _queues.size()];
+            lock_guard<mutex> lock(queue._lock);
+            queue._tasks.push_back(&tasks[loop]);
+        }
+        {
+            lock_guard<mutex> lock(_lock);
+            _queued += tasks.size();
+            _remaining += tasks.size();
+        }
+        _wake.notify_all();
 
-        int startTime = timeGetTime();
-        for (int loop = 0; loop < NUM_ITERATIONS; loop++)
+        while (RunOneTask(-1))
         {
-            int index = loop % size;
-            const string& word = dictionary->GetString(index);
-            if (Find(word))
-            {
-                foundCount++;
-            }
         }
-        int endTime = timeGetTime() - startTime;
-        cout << endTime << "ms" << " to test map (found " << foundCount << "/" << NUM_ITERATIONS << ")" << endl;
+        unique_lock<mutex> lock(_lock);
+        _done.wait(lock, [this]() { return _remaining == 0; });
     }
 
-    // Find "word" in the collision table
-    // return true if found, false otherwise.
-    bool    FindCollision(const StringHash& key, const string& word) const
+    int     GetThreadCount() const
+    {
+        return _threads.size();
+    }
+
+private:
+    struct WorkQueue
+    {
+        mutex                       _lock;
+        deque< function<void()>* >  _tasks;
+    };
+
+    void    WorkerLoop(int index)
     {
-        map<StringHash, vector<string> >::const_iterator it;     // iterator for collisions
-        it = _collisions.find(key);
-        if (it != _collisions.end())
+        for (;;)
         {
-            const vector<string>& wordList = it->second;
-            for (vector<string>::const_iterator iter = wordList.begin(); iter != wordList.end(); ++iter)
-            {
-                if ( strcmp( word.c_str(), (*iter).c_str()) == 0)
-                    return true;
-            }
+            if (RunOneTask(index))
+                continue;
+
+            unique_lock<mutex> lock(_lock);
+            _wake.wait(lock, [this]() { return _stop || _queued > 0; });
+            if (_stop)
+                return;
         }
-        return false;
     }
 
-protected:
-    void    ResolveCollisions(map<StringHash, string>& wordMap)
+    // Run a task from the front of queue "index", or if that's empty, one from the back
+    // of any other queue. An "index" of -1 only steals.
+    // return false if there were no tasks left
+    bool    RunOneTask(int index)
     {
-        // resolve any collisions. Move collided objects still in the associative array
-        // into the collision table
-        map<StringHash, vector<string> >::iterator colIt;     // iterator for collisions
-        for (colIt = _collisions.begin(); colIt != _collisions.end(); ++colIt)
+        function<void()>* task = NULL;
+        int numQueues = _queues.size();
+        for (int loop = 0; loop < numQueues && task == NULL; loop++)
         {
-            StringHash  hash = (*colIt).first;
-            map<StringHash, string>::iterator it = wordMap.find(hash);
-            if (it != wordMap.end() )
+            int queueIndex = (index + numQueues + loop) % numQueues;
+            WorkQueue& queue = *_queues[queueIndex];
+            lock_guard<mutex> lock(queue._lock);
+            if (queue._tasks.empty())
+                continue;
+            if (queueIndex == index)
             {
-                (*colIt).second.push_back( (*it).second);
-                cout << "key " << (*it).first << " moving to collisions: value " << (*it).second << endl;
-                wordMap.erase(hash);
+                task = queue._tasks.front();
+                queue._tasks.pop_front();
             }
             else
             {
-                cout << "ERROR: Collision not in original map. This should NEVER happen" << endl;
+                task = queue._tasks.back();
+                queue._tasks.pop_back();
             }
         }
-    }
+        if (task == NULL)
+            return false;
 
-    void    AddCollision(const KVPair& kvPair, const StringHash& hash)
-    {
-        // This key has collided with something already in the map, so add this to the
-        // collisions table
-        map<StringHash, vector<string> >::iterator colIt = _collisions.find(hash);
-        if (colIt != _collisions.end())
-        {
-            // already in the list, add it here
-            (*colIt).second.push_back( kvPair._value);
-            cout << "key " << kvPair._key << " already in list: value " << kvPair._value << endl;
-        }
-        else
+        _queued--;
+        (*task)();
+        if (--_remaining == 0)
         {
-            // add a new set of data
-            vector<string>  collision;
-            collision.push_back( kvPair._value);
-            _collisions.insert(make_pair(hash, collision));
-            cout << "key " << kvPair._key << " collided with value " << kvPair._value << endl;
+            lock_guard<mutex> lock(_lock);
+            _done.notify_all();
         }
+        return true;
     }
 
-    map<StringHash, vector<string> >    _collisions;
+    vector< unique_ptr<WorkQueue> > _queues;
+    vector<thread>          _threads;
+    mutex                   _lock;          // guards waiting on _wake and _done
+    condition_variable      _wake;          // tasks have been queued, or the pool is stopping
+    condition_variable      _done;          // the last task of a Run has finished
+    atomic<int>             _queued;        // tasks not yet taken from a queue
+    atomic<int>             _remaining;     // tasks not yet finished
+    bool                    _stop;
 };
 
-// A class describing a large monolithic map of words
-// This would be the standard implementation in any
-// dictionary-based program.
-class MonolithicMap : public HashMapBase
+// the pool CreateMap builds partitions on, one thread per available CPU
+static WorkStealingPool& GetThreadPool()
+{
+    static WorkStealingPool pool(GetAvailableCpus().size());
+    return pool;
+}
+
+// An HDR-style histogram of latencies. Values are split into power-of-two ranges and
+// each range into SUB_BUCKETS linear sub-buckets, so every recorded value is kept to
+// within 1/64th of its size whatever its magnitude, at a fixed memory cost.
+// Recording is an index calculation and an increment, cheap enough for the hot loop.
+class LatencyHistogram
 {
 public:
-    MonolithicMap()
+    LatencyHistogram()
+        : _counts(NUM_MAGNITUDES * SUB_BUCKETS, 0)
+        , _count(0)
+        , _total(0)
+        , _max(0)
     {
     }
 
-    virtual ~MonolithicMap()
+    void    Record(unsigned long long value)
     {
+        _counts[GetIndex(value)]++;
+        _count++;
+        _total += value;
+        if (value > _max)
+        {
+            _max = value;
+        }
     }
 
-    void    CreateMap(Dictionary* dictionary)
+    void    Merge(const LatencyHistogram& other)
     {
-        int size = dictionary->GetSize();
-        for (int loop = 0; loop < size; loop++)
+        for (size_t loop = 0; loop < _counts.size(); loop++)
         {
-            const KVPair& kvPair = dictionary->GetKVPair(loop);
-
-            // create the hash for the current string
-            StringHash hash = StringHash( kvPair._key );
+            _counts[loop] += other._counts[loop];
+        }
+        _count += other._count;
+        _total += other._total;
+        _max = max(_max, other._max);
+    }
 
-            // insert it into the standard associative array if it isn't there already
-            if (_wordMap.find(hash) == _wordMap.end())
-            {
-                _wordMap.insert(make_pair(hash, kvPair._value));
-            }
-            else
+    // return the value at or below which "percentile" percent of values fall
+    unsigned long long  GetPercentile(double percentile) const
+    {
+        unsigned long long target = (unsigned long long)ceil(percentile / 100.0 * _count);
+        unsigned long long count = 0;
+        for (size_t loop = 0; loop < _counts.size(); loop++)
+        {
+            count += _counts[loop];
+            if (count >= target && count > 0)
             {
-                AddCollision(kvPair, hash);
+                return min(GetHighestValue(loop), _max);
             }
         }
-        ResolveCollisions(_wordMap);
+        return _max;
     }
 
-    bool    Find(const string& wordToFind) const
+    unsigned long long  GetCount() const
     {
-        StringHash key = StringHash( wordToFind );
-        if (_wordMap.find(key) != _wordMap.end())
-            return true;
-        if (FindCollision(key, wordToFind) )
-            return true;
-        return false;
+        return _count;
     }
 
-private:
-    // store for the standard map of HashKey<->string
-    map<StringHash, string>             _wordMap;
-};
-
-// A class describing large monolithic maps; one for each individual letter.
-// This will use the first letter as a lookup. It should also reduce the likelyhood
-// of collisions
-class MonolithicLetterMap : public HashMapBase
-{
-public:
-    MonolithicLetterMap()
+    unsigned long long  GetMax() const
     {
+        return _max;
     }
 
-    virtual ~MonolithicLetterMap()
+    double  GetMean() const
     {
+        return _count ? (double)_total / _count : 0.0;
     }
 
-    void    CreateMap(Dictionary* dictionary)
-    {
-        int size = dictionary->GetSize();
-        for (int loop = 0; loop < size; loop++)
-        {
-            const KVPair& kvPair = dictionary->GetKVPair(loop);
-            const char* str = kvPair._value.c_str();
-            int index = str[0] - 'a';
-
-            // create the hash for the current string
-            StringHash hash = StringHash( kvPair._key );
+private:
+    static const int SUB_BUCKET_BITS = 7;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int NUM_MAGNITUDES = 64 - SUB_BUCKET_BITS + 1;
 
-            // insert it into the standard associative array if it isn't there already
-            if (_wordMap[index].find(hash) == _wordMap[index].end())
-            {
-                _wordMap[index].insert(make_pair(hash, kvPair._value));
-            }
-            else
-            {
-                AddCollision(kvPair, hash);
-            }
-        }
-        for (int loop = 0; loop < NUM_LETTERS; loop++)
-        {
-            ResolveCollisions(_wordMap[loop]);
-        }
+    static inline size_t GetIndex(unsigned long long value)
+    {
+        int magnitude = max(GetBitLength(value) - SUB_BUCKET_BITS, 0);
+        return magnitude * SUB_BUCKETS + (size_t)(value >> magnitude);
     }
 
-    bool    Find(const string& wordToFind) const
+    static unsigned long long GetHighestValue(size_t index)
     {
-        int letterIndex = wordToFind[0] - 'a';
-        StringHash key = StringHash( wordToFind );
-        if (_wordMap[letterIndex].find(key) != _wordMap[letterIndex].end())
-            return true;
-        if (FindCollision(key, wordToFind) )
-            return true;
-        return false;
+        int magnitude = (int)(index / SUB_BUCKETS);
+        unsigned long long subBucket = index % SUB_BUCKETS;
+        return ((subBucket + 1) << magnitude) - 1;
     }
 
-private:
-    // store for the standard map of HashKey<->string
-    map<StringHash, string>             _wordMap[NUM_LETTERS];
+    vector<unsigned long long>  _counts;
+    unsigned long long          _count;
+    unsigned long long          _total;
+    unsigned long long          _max;
 };
 
-// The hashMap structure for each list of words beginning with a certain letter
-// since all letters will have a different amount of words in, the _arraySize
-// will be used to optimally pick the best array size, ie the array will be bigger
-// for words starting with "e" than for words starting with "x"
-struct HashArray
-{
-    int                                _arraySize;
-    vector< map<StringHash, string> >  _hashMap;
-};
+/////////////////////////////////////////////////////////////////////////////////////////
+// Memory accounting
+//
+// Built with COUNT_ALLOCATIONS defined, everything allocated with new, by the maps, the
+// dictionary and the standard containers inside them, goes through the operator new
+// and delete below, which count the bytes and blocks in use. The heap a map keeps is
+// the difference across its CreateMap, with no allocator threaded through each of its
+// containers. Each block carries its size in a header in front of it.
+// The header changes the size of every node and the counters are shared by all
+// threads, so without COUNT_ALLOCATIONS none of it is compiled and the maps are timed
+// on the real allocator. Only the resident set size is measured then. Memory mapped
+// files aren't on the heap, but show up in the resident set size once they're read.
 
-class HashMap : public HashMapBase
+#if defined(COUNT_ALLOCATIONS)
+static const size_t         HEAP_HEADER_SIZE = 16;      // holds the size and header size, and keeps malloc's alignment
+
+static atomic<long long>    g_heapBytes(0);             // allocated and not yet freed
+static atomic<long long>    g_heapBlocks(0);            // blocks not yet freed
+static atomic<long long>    g_heapAllocations(0);       // blocks ever allocated
+static atomic<long long>    g_heapPeakBytes(0);         // most bytes in use at once since ResetHeapPeak
+
+static void* AllocateCounted(size_t size, size_t alignment)
 {
-public:
-    HashMap()
+    size_t header = max(alignment, HEAP_HEADER_SIZE);
+#if defined(_WIN32)
+    char* block = (char*)_aligned_malloc(size + header, header);
+#else
+    char* block = NULL;
+    if (alignment <= HEAP_HEADER_SIZE)
     {
+        block = (char*)malloc(size + header);
     }
-
-    ~HashMap()
+    else if (posix_memalign((void**)&block, alignment, size + header) != 0)
     {
+        block = NULL;
     }
+#endif
+    if (!block)
+        throw bad_alloc();
 
-    void    CreateMap(Dictionary* dictionary)
+    size_t* sizes = (size_t*)(block + header);
+    sizes[-1] = size;
+    sizes[-2] = header;
+
+    long long bytes = g_heapBytes.fetch_add(size, memory_order_relaxed) + size;
+    g_heapBlocks.fetch_add(1, memory_order_relaxed);
+    g_heapAllocations.fetch_add(1, memory_order_relaxed);
+    long long peak = g_heapPeakBytes.load(memory_order_relaxed);
+    while (bytes > peak && !g_heapPeakBytes.compare_exchange_weak(peak, bytes, memory_order_relaxed))
     {
-        for (int loop = 0; loop < NUM_LETTERS; loop++)
-        {
-            HashArray&  hashMap = _hashMap[loop];
-            hashMap._hashMap.clear();
+    }
+    return block + header;
+}
 
-            int arraySize = dictionary->GetWordCount(loop) / 8;
-            arraySize = GetNearestPrimeNumberTo(arraySize);
-            hashMap._arraySize = arraySize;
-            hashMap._hashMap.resize(hashMap._arraySize);
-        }
+static void FreeCounted(void* pointer)
+{
+    if (!pointer)
+        return;
 
-        // move words from the dictionary into the map
-        int size = dictionary->GetSize();
-        for (int loop = 0; loop < size; loop++)
-        {
-            const KVPair& kvPair = dictionary->GetKVPair(loop);
-            const char* str = kvPair._value.c_str();
-            int letterIndex = str[0] - 'a';
+    size_t* sizes = (size_t*)pointer;
+    g_heapBytes.fetch_sub(sizes[-1], memory_order_relaxed);
+    g_heapBlocks.fetch_sub(1, memory_order_relaxed);
+#if defined(_WIN32)
+    _aligned_free((char*)pointer - sizes[-2]);
+#else
+    free((char*)pointer - sizes[-2]);
+#endif
+}
 
-            HashArray&  hashMap = _hashMap[letterIndex];
+void* operator new(size_t size)
+{
+    return AllocateCounted(size, HEAP_HEADER_SIZE);
+}
 
-            // take modulo and insert it into the hash map.
-            unsigned int bucketIndex = kvPair._key % hashMap._arraySize;
+void* operator new[](size_t size)
+{
+    return AllocateCounted(size, HEAP_HEADER_SIZE);
+}
 
-            // create the hash for the current string
-            StringHash hash = StringHash( kvPair._key );
+void* operator new(size_t size, align_val_t alignment)
+{
+    return AllocateCounted(size, (size_t)alignment);
+}
 
-            // insert it into the standard associative array if it isn't there already
-            if (hashMap._hashMap[bucketIndex].find(hash) == hashMap._hashMap[bucketIndex].end())
-            {
-                hashMap._hashMap[bucketIndex].insert(make_pair(hash, kvPair._value));
-            }
-            else
-            {
-                AddCollision(kvPair, hash);
-            }
-        }
+void* operator new[](size_t size, align_val_t alignment)
+{
+    return AllocateCounted(size, (size_t)alignment);
+}
 
-        for (int letterLoop = 0; letterLoop < NUM_LETTERS; letterLoop++)
-        {
-            HashArray&  hashMap = _hashMap[letterLoop];
-            int arraySize = hashMap._arraySize;
-            for (int loop = 0; loop < arraySize; loop++)
-            {
-                ResolveCollisions(hashMap._hashMap[loop]);
-            }
-        }
+void operator delete(void* pointer) noexcept
+{
+    FreeCounted(pointer);
+}
 
-        // dump out stats for buckets
-        for (int letterLoop = 0; letterLoop < NUM_LETTERS; letterLoop++)
-        {
-            int numEmptyBuckets = 0;
-            int maxBucketSize = 0;
-            HashArray&  hashMap = _hashMap[letterLoop];
-            int numBuckets = hashMap._arraySize;
-            for (int loop = 0; loop < numBuckets; loop++)
-            {
-                map<StringHash, string>&    bucketMap = hashMap._hashMap[loop];
-                int size = bucketMap.size();
-                if (size == 0)
-                {
-                    numEmptyBuckets++;
-                }
-                if (size > maxBucketSize)
-                {
-                    maxBucketSize = size;
-                }
-            }
-            cout << "Bucket Size for " << letterLoop << ": " << numBuckets << ", Num Empty buckets: " << numEmptyBuckets << ", maxBucketSize: " << maxBucketSize << endl;
-        }
-    }
+void operator delete[](void* pointer) noexcept
+{
+    FreeCounted(pointer);
+}
 
-    bool    Find(const string& wordToFind) const
-    {
-        int letterIndex = wordToFind[0] - 'a';
-        StringHash key = StringHash( wordToFind );
-        const HashArray&  hashMap = _hashMap[letterIndex];
-        unsigned int bucketIndex = key % hashMap._arraySize;
-        if (hashMap._hashMap[bucketIndex].find(key) != hashMap._hashMap[bucketIndex].end())
-            return true;
-        if (FindCollision(key, wordToFind) )
-            return true;
-        return false;
-    }
+void operator delete(void* pointer, size_t) noexcept
+{
+    FreeCounted(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept
+{
+    FreeCounted(pointer);
+}
+
+void operator delete(void* pointer, align_val_t) noexcept
+{
+    FreeCounted(pointer);
+}
+
+void operator delete[](void* pointer, align_val_t) noexcept
+{
+    FreeCounted(pointer);
+}
+
+void operator delete(void* pointer, size_t, align_val_t) noexcept
+{
+    FreeCounted(pointer);
+}
+
+void operator delete[](void* pointer, size_t, align_val_t) noexcept
+{
+    FreeCounted(pointer);
+}
+#endif
+
+// Start the peak heap from what's in use now
+static void ResetHeapPeak()
+{
+#if defined(COUNT_ALLOCATIONS)
+    g_heapPeakBytes.store(g_heapBytes.load(memory_order_relaxed), memory_order_relaxed);
+#endif
+}
+
+// The heap in use, and the resident set size of the process now and at its largest.
+// The heap figures are -1 without COUNT_ALLOCATIONS, and the RSS ones where they
+// aren't known
+struct MemoryUsage
+{
+    static MemoryUsage  Get()
+    {
+        MemoryUsage usage;
+#if defined(COUNT_ALLOCATIONS)
+        usage._heapBytes = g_heapBytes.load(memory_order_relaxed);
+        usage._heapBlocks = g_heapBlocks.load(memory_order_relaxed);
+        usage._heapAllocations = g_heapAllocations.load(memory_order_relaxed);
+        usage._heapPeakBytes = g_heapPeakBytes.load(memory_order_relaxed);
+#else
+        usage._heapBytes = -1;
+        usage._heapBlocks = -1;
+        usage._heapAllocations = -1;
+        usage._heapPeakBytes = -1;
+#endif
+        usage._rssBytes = -1;
+        usage._peakRssBytes = -1;
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        {
+            usage._rssBytes = counters.WorkingSetSize;
+            usage._peakRssBytes = counters.PeakWorkingSetSize;
+        }
+#else
+        rusage resources;
+        if (getrusage(RUSAGE_SELF, &resources) == 0)
+        {
+#if defined(__APPLE__)
+            usage._peakRssBytes = resources.ru_maxrss;
+#else
+            usage._peakRssBytes = resources.ru_maxrss * 1024LL;
+#endif
+        }
+#if defined(__linux__)
+        ifstream statm("/proc/self/statm");
+        long long pages, residentPages;
+        if (statm >> pages >> residentPages)
+        {
+            usage._rssBytes = residentPages * sysconf(_SC_PAGESIZE);
+        }
+#endif
+#endif
+        // the peak is only updated every so often, so it can trail the current size
+        if (usage._peakRssBytes >= 0)
+        {
+            usage._peakRssBytes = max(usage._peakRssBytes, usage._rssBytes);
+        }
+        return usage;
+    }
+
+    long long   _heapBytes;
+    long long   _heapBlocks;
+    long long   _heapAllocations;
+    long long   _heapPeakBytes;
+    long long   _rssBytes;
+    long long   _peakRssBytes;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Instrumentation
+//
+// Built with INSTRUMENT_MAPS defined, the maps count the work done by each lookup and
+// time the phases of CreateMap, RunTest reads the CPU's hardware counters around its
+// timed passes where perf_event_open allows it, and all of it goes into the results.
+// Without INSTRUMENT_MAPS none of it is compiled, so the lookups timed are untouched.
+
+#if defined(INSTRUMENT_MAPS)
+#define INSTRUMENT(code)    code
+#else
+#define INSTRUMENT(code)
+#endif
+
+// What the lookups on one thread did. A probe is whatever a map's search steps
+// through to reach a word: slots, groups of slots, tree nodes or the words in a
+// bucket. A chained lookup had to look past the first word with its hash.
+struct LookupStats
+{
+    static const int    MAX_PROBES = 32;        // longer searches are counted as this many
+
+    LookupStats()
+    {
+        Reset();
+    }
+
+    void    Reset()
+    {
+        _lookups = 0;
+        _chained = 0;
+        _probed = 0;
+        for (int loop = 0; loop <= MAX_PROBES; loop++)
+        {
+            _probes[loop] = 0;
+        }
+    }
+
+    void    RecordProbes(size_t probes)
+    {
+        _probes[min(probes, (size_t)MAX_PROBES)]++;
+        _probed++;
+    }
+
+    void    RecordChained()
+    {
+        _chained++;
+    }
+
+    void    AddLookups(int count)
+    {
+        _lookups += count;
+    }
+
+    double  GetMeanProbes() const
+    {
+        unsigned long long total = 0;
+        for (int loop = 0; loop <= MAX_PROBES; loop++)
+        {
+            total += _probes[loop] * loop;
+        }
+        return _probed ? (double)total / _probed : 0.0;
+    }
+
+    unsigned long long  _lookups;                   // lookups made
+    unsigned long long  _chained;                   // lookups that were chained
+    unsigned long long  _probed;                    // lookups that recorded their probes
+    unsigned long long  _probes[MAX_PROBES + 1];    // lookups by number of probes
+};
+
+#if defined(INSTRUMENT_MAPS)
+static thread_local LookupStats g_lookupStats;
+#endif
+
+enum HardwareCounter
+{
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    NUM_HARDWARE_COUNTERS
+};
+
+static const char* GetHardwareCounterName(int counter)
+{
+    static const char* names[] = { "instructions", "cache_misses", "branch_misses" };
+    return names[counter];
+}
+
+#if defined(INSTRUMENT_MAPS) && defined(__linux__)
+// The HardwareCounter events for the calling thread, in user space only, read together
+// as one group. Counting is off until Start, and Stop pauses it, so the counts can be
+// kept over several passes. Many VMs and containers don't allow perf_event_open, in
+// which case IsOpen is false.
+class HardwareCounters
+{
+public:
+    HardwareCounters()
+    {
+        static const unsigned long long configs[NUM_HARDWARE_COUNTERS] =
+        {
+            PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+        };
+        for (int loop = 0; loop < NUM_HARDWARE_COUNTERS; loop++)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[loop];
+            attr.disabled = loop == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            _events[loop] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, loop == 0 ? -1 : _events[0], 0);
+        }
+        if (!IsOpen())
+        {
+            Close();
+        }
+    }
+
+    ~HardwareCounters()
+    {
+        Close();
+    }
+
+    bool    IsOpen() const
+    {
+        for (int loop = 0; loop < NUM_HARDWARE_COUNTERS; loop++)
+        {
+            if (_events[loop] < 0)
+                return false;
+        }
+        return true;
+    }
+
+    void    Start()
+    {
+        ioctl(_events[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    void    Stop()
+    {
+        ioctl(_events[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    // read the counts so far into "counts"
+    bool    Read(unsigned long long counts[NUM_HARDWARE_COUNTERS]) const
+    {
+        unsigned long long values[NUM_HARDWARE_COUNTERS + 1];
+        if (read(_events[0], values, sizeof(values)) != (ssize_t)sizeof(values) || values[0] != NUM_HARDWARE_COUNTERS)
+            return false;
+        memcpy(counts, values + 1, sizeof(unsigned long long) * NUM_HARDWARE_COUNTERS);
+        return true;
+    }
+
+private:
+    void    Close()
+    {
+        for (int loop = NUM_HARDWARE_COUNTERS - 1; loop >= 0; loop--)
+        {
+            if (_events[loop] >= 0)
+            {
+                close(_events[loop]);
+                _events[loop] = -1;
+            }
+        }
+    }
+
+    int     _events[NUM_HARDWARE_COUNTERS];
+};
+#endif
+
+// Hit latencies are also kept by the length of the word, in buckets split where words
+// stop fitting in the slots of the InlineWordStorage sizes
+static const unsigned int   WORD_LENGTH_LIMITS[] = { 8, 16, 24 };   // the words in each bucket are shorter than its limit
+static const int            NUM_WORD_LENGTH_BUCKETS = sizeof(WORD_LENGTH_LIMITS) / sizeof(WORD_LENGTH_LIMITS[0]) + 1;
+
+static int GetWordLengthBucket(size_t length)
+{
+    int bucket = 0;
+    while (bucket < NUM_WORD_LENGTH_BUCKETS - 1 && length >= WORD_LENGTH_LIMITS[bucket])
+    {
+        bucket++;
+    }
+    return bucket;
+}
+
+// return the lengths in "bucket", such as "8-15" or "24+"
+static string GetWordLengthBucketName(int bucket)
+{
+    unsigned int first = bucket > 0 ? WORD_LENGTH_LIMITS[bucket - 1] : 1;
+    if (bucket == NUM_WORD_LENGTH_BUCKETS - 1)
+    {
+        return to_string(first) + "+";
+    }
+    return to_string(first) + "-" + to_string(WORD_LENGTH_LIMITS[bucket] - 1);
+}
+
+// Results of RunTest for one map. Latencies are in ticks, see GetNanosecondsPerTick()
+struct BenchmarkResult
+{
+    BenchmarkResult()
+        : _iterations(0)
+        , _found(0)
+        , _hashGbPerSecond(0.0)
+        , _hashCollisions(-1)
+        , _missMs(-1.0)
+        , _falsePositiveRate(-1.0)
+        , _heapBytesPerWord(-1.0)
+        , _heapBlocks(0)
+        , _buildAllocations(0)
+        , _buildPeakBytesPerWord(-1.0)
+        , _rssBytes(-1)
+        , _peakRssBytes(-1)
+        , _deleteMs(-1.0)
+    {
+        for (int loop = 0; loop < NUM_HARDWARE_COUNTERS; loop++)
+        {
+            _perLookup[loop] = -1.0;
+        }
+    }
+
+    string              _name;
+    string              _workload;      // Workload::GetName of the queries
+    int                 _iterations;
+    int                 _found;
+    vector<double>      _trialMs;       // total time of each timed trial
+    LatencyHistogram    _latency;       // per-lookup latency over all trials
+    LatencyHistogram    _hitLatency[NUM_WORD_LENGTH_BUCKETS];   // latency of the words found, by length bucket
+    vector< pair<int, double> > _batchMs;   // best time for each FindBatch size, if run
+    double              _hashGbPerSecond;   // hash function speed, from RunHashTest
+    int                 _hashCollisions;    // distinct words sharing a hash. -1 if not measured
+    vector< pair<int, double> > _threadLookupsPerSecond;   // total throughput for each thread count, if run
+    double              _missMs;            // best time for NUM_ITERATIONS missing words. -1 if not measured
+    double              _falsePositiveRate; // of the map's filter, if it has one. -1 if not measured
+    LookupStats         _lookupStats;       // what the timed lookups did, if instrumented
+    vector< pair<string, double> > _buildMs;    // time of each phase of CreateMap, if instrumented
+    double              _perLookup[NUM_HARDWARE_COUNTERS];  // hardware counts per timed lookup. -1 if not measured
+    double              _heapBytesPerWord;  // heap the map kept after CreateMap, per dictionary word. -1 if not measured
+    long long           _heapBlocks;        // blocks the map kept
+    long long           _buildAllocations;  // blocks CreateMap allocated, including the ones it freed
+    double              _buildPeakBytesPerWord; // most heap the map had in use during CreateMap, per word
+    long long           _rssBytes;          // resident set size of the process after CreateMap. -1 if not known
+    long long           _peakRssBytes;      // largest resident set size of the process so far. -1 if not known
+    double              _deleteMs;          // time to delete the map. -1 if not measured
+};
+
+// What one thread of RunThreadedTest measured. Each is on its own cache lines so
+// threads never write to a line another thread is writing to
+struct alignas(64) ThreadResult
+{
+    ThreadResult()
+        : _found(0)
+    {
+    }
+
+    int                                 _found;
+    chrono::steady_clock::time_point    _startTime;
+    chrono::steady_clock::time_point    _endTime;
+    LatencyHistogram                    _latency;
+};
+
+static void WriteResultsCsv(ostream& out, const vector<BenchmarkResult>& results)
+{
+    double nsPerTick = GetNanosecondsPerTick();
+    out << "map,workload,iterations,found,trials,best_ms,mean_ms,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,bytes_per_word,blocks,rss_bytes,peak_rss_bytes" << endl;
+    for (size_t loop = 0; loop < results.size(); loop++)
+    {
+        const BenchmarkResult& result = results[loop];
+        const LatencyHistogram& latency = result._latency;
+        double bestMs = *min_element(result._trialMs.begin(), result._trialMs.end());
+        double meanMs = 0.0;
+        for (size_t trial = 0; trial < result._trialMs.size(); trial++)
+        {
+            meanMs += result._trialMs[trial] / result._trialMs.size();
+        }
+        // map and workload names have commas in them, so they are quoted
+        out << "\"" << result._name << "\",\"" << result._workload << "\"," << result._iterations << "," << result._found << ","
+            << result._trialMs.size() << "," << bestMs << "," << meanMs << ","
+            << latency.GetMean() * nsPerTick << ","
+            << latency.GetPercentile(50.0) * nsPerTick << ","
+            << latency.GetPercentile(99.0) * nsPerTick << ","
+            << latency.GetPercentile(99.9) * nsPerTick << ","
+            << latency.GetMax() * nsPerTick << ",";
+        if (result._heapBytesPerWord >= 0.0)
+        {
+            out << result._heapBytesPerWord << "," << result._heapBlocks;
+        }
+        else
+        {
+            out << ",";
+        }
+        out << ",";
+        if (result._rssBytes >= 0)
+        {
+            out << result._rssBytes << "," << result._peakRssBytes;
+        }
+        else
+        {
+            out << ",";
+        }
+        out << endl;
+    }
+}
+
+static void WriteResultsJson(ostream& out, const vector<BenchmarkResult>& results)
+{
+    double nsPerTick = GetNanosecondsPerTick();
+    out << "[" << endl;
+    for (size_t loop = 0; loop < results.size(); loop++)
+    {
+        const BenchmarkResult& result = results[loop];
+        const LatencyHistogram& latency = result._latency;
+        out << "  { \"map\": \"" << result._name << "\", \"workload\": \"" << result._workload << "\""
+            << ", \"iterations\": " << result._iterations
+            << ", \"found\": " << result._found << ", \"trial_ms\": [";
+        for (size_t trial = 0; trial < result._trialMs.size(); trial++)
+        {
+            out << (trial ? ", " : "") << result._trialMs[trial];
+        }
+        out << "], \"latency_ns\": { \"mean\": " << latency.GetMean() * nsPerTick
+            << ", \"p50\": " << latency.GetPercentile(50.0) * nsPerTick
+            << ", \"p99\": " << latency.GetPercentile(99.0) * nsPerTick
+            << ", \"p99.9\": " << latency.GetPercentile(99.9) * nsPerTick
+            << ", \"max\": " << latency.GetMax() * nsPerTick << " }";
+        out << ", \"hit_p50_ns_by_length\": {";
+        for (int bucket = 0, written = 0; bucket < NUM_WORD_LENGTH_BUCKETS; bucket++)
+        {
+            if (result._hitLatency[bucket].GetCount() > 0)
+            {
+                out << (written++ ? ", " : " ") << "\"" << GetWordLengthBucketName(bucket) << "\": " << result._hitLatency[bucket].GetPercentile(50.0) * nsPerTick;
+            }
+        }
+        out << " }";
+        if (!result._batchMs.empty())
+        {
+            out << ", \"batch_ms\": {";
+            for (size_t batch = 0; batch < result._batchMs.size(); batch++)
+            {
+                out << (batch ? ", " : " ") << "\"" << result._batchMs[batch].first << "\": " << result._batchMs[batch].second;
+            }
+            out << " }";
+        }
+        if (!result._threadLookupsPerSecond.empty())
+        {
+            out << ", \"threads_lookups_per_s\": {";
+            for (size_t threads = 0; threads < result._threadLookupsPerSecond.size(); threads++)
+            {
+                out << (threads ? ", " : " ") << "\"" << result._threadLookupsPerSecond[threads].first << "\": " << result._threadLookupsPerSecond[threads].second;
+            }
+            out << " }";
+        }
+        if (result._missMs >= 0.0)
+        {
+            out << ", \"miss_ms\": " << result._missMs;
+        }
+        if (result._falsePositiveRate >= 0.0)
+        {
+            out << ", \"false_positive_rate\": " << result._falsePositiveRate;
+        }
+        if (result._hashCollisions >= 0)
+        {
+            out << ", \"hash_gb_per_s\": " << result._hashGbPerSecond << ", \"hash_collisions\": " << result._hashCollisions;
+        }
+        if (!result._buildMs.empty())
+        {
+            out << ", \"build_ms\": {";
+            for (size_t phase = 0; phase < result._buildMs.size(); phase++)
+            {
+                out << (phase ? ", " : " ") << "\"" << result._buildMs[phase].first << "\": " << result._buildMs[phase].second;
+            }
+            out << " }";
+        }
+        const LookupStats& stats = result._lookupStats;
+        if (stats._lookups > 0)
+        {
+            out << ", \"chained_rate\": " << (double)stats._chained / stats._lookups;
+        }
+        if (stats._probed > 0)
+        {
+            out << ", \"mean_probes\": " << stats.GetMeanProbes() << ", \"probes\": {";
+            for (int probes = 0, written = 0; probes <= LookupStats::MAX_PROBES; probes++)
+            {
+                if (stats._probes[probes] > 0)
+                {
+                    out << (written++ ? ", " : " ") << "\"" << probes << "\": " << stats._probes[probes];
+                }
+            }
+            out << " }";
+        }
+        if (result._heapBytesPerWord >= 0.0 || result._rssBytes >= 0)
+        {
+            out << ", \"memory\": { ";
+            if (result._heapBytesPerWord >= 0.0)
+            {
+                out << "\"bytes_per_word\": " << result._heapBytesPerWord
+                    << ", \"blocks\": " << result._heapBlocks
+                    << ", \"build_allocations\": " << result._buildAllocations
+                    << ", \"build_peak_bytes_per_word\": " << result._buildPeakBytesPerWord << ", ";
+            }
+            out << "\"rss_bytes\": " << result._rssBytes
+                << ", \"peak_rss_bytes\": " << result._peakRssBytes << " }";
+        }
+        if (result._deleteMs >= 0.0)
+        {
+            out << ", \"delete_ms\": " << result._deleteMs;
+        }
+        if (result._perLookup[0] >= 0.0)
+        {
+            out << ", \"per_lookup\": {";
+            for (int counter = 0; counter < NUM_HARDWARE_COUNTERS; counter++)
+            {
+                out << (counter ? ", " : " ") << "\"" << GetHardwareCounterName(counter) << "\": " << result._perLookup[counter];
+            }
+            out << " }";
+        }
+        out << " }"
+            << (loop + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "]" << endl;
+}
+
+// Record in "result" the memory its map uses, from the MemoryUsage before and after
+// its CreateMap, for a dictionary of "words". The heap is left unmeasured if the
+// allocations weren't counted
+static void RecordMapMemory(const MemoryUsage& before, const MemoryUsage& after, int words, BenchmarkResult& result)
+{
+    words = max(words, 1);
+    result._rssBytes = after._rssBytes;
+    result._peakRssBytes = after._peakRssBytes;
+
+    cout << "  memory:";
+    if (after._heapBytes >= 0)
+    {
+        result._heapBytesPerWord = (double)(after._heapBytes - before._heapBytes) / words;
+        result._heapBlocks = after._heapBlocks - before._heapBlocks;
+        result._buildAllocations = after._heapAllocations - before._heapAllocations;
+        result._buildPeakBytesPerWord = (double)(after._heapPeakBytes - before._heapBytes) / words;
+        cout << " " << result._heapBytesPerWord << " bytes/word in " << result._heapBlocks << " blocks, "
+             << result._buildAllocations << " allocations and a peak of " << result._buildPeakBytesPerWord << " bytes/word while building";
+    }
+    else
+    {
+        cout << " heap not counted";
+    }
+    if (result._rssBytes >= 0)
+    {
+        cout << ", RSS " << result._rssBytes / (1024.0 * 1024.0) << "MB";
+    }
+    if (result._peakRssBytes >= 0)
+    {
+        cout << ", peak RSS " << result._peakRssBytes / (1024.0 * 1024.0) << "MB";
+    }
+    cout << endl;
+}
+
+// Print whatever of the instrumentation "result" has. Nothing without INSTRUMENT_MAPS
+static void PrintInstrumentation(const BenchmarkResult& result)
+{
+    if (!result._buildMs.empty())
+    {
+        cout << "  build:";
+        for (size_t phase = 0; phase < result._buildMs.size(); phase++)
+        {
+            cout << " " << result._buildMs[phase].first << " " << result._buildMs[phase].second << "ms";
+        }
+        cout << endl;
+    }
+    const LookupStats& stats = result._lookupStats;
+    if (stats._lookups > 0)
+    {
+        cout << "  lookups: " << 100.0 * stats._chained / stats._lookups << "% chained";
+        if (stats._probed > 0)
+        {
+            cout << ", mean " << stats.GetMeanProbes() << " probes";
+        }
+        cout << endl;
+    }
+    if (result._perLookup[0] >= 0.0)
+    {
+        cout << "  per lookup:";
+        for (int counter = 0; counter < NUM_HARDWARE_COUNTERS; counter++)
+        {
+            cout << " " << GetHardwareCounterName(counter) << " " << result._perLookup[counter];
+        }
+        cout << endl;
+    }
+}
+
+// A string stored in a StringArena
+struct StringRef
+{
+    unsigned int    _offset;
+    unsigned int    _length;
+};
+
+// Storage for every word, shared by the dictionary and all the maps built from it, so
+// each word is only stored once however many maps are loaded. The maps hold 8-byte
+// StringRefs into the arena in place of their own copies of the words.
+// The arena starts with the buffer the dictionary was loaded into. Words added later
+// are appended in fixed-size chunks that never move, so a StringRef stays valid and
+// finding a string from one is O(1). A string too long for a chunk gets a block of
+// several chunks to itself. Every string added is followed by a NUL, but the
+// words in the base buffer aren't, as a mapped file is never written to.
+// An arena can instead start with another, its parent, so a map can add words of its
+// own without writing to the dictionary's arena, which other maps share, while every
+// StringRef into the dictionary's arena stays valid in its own.
+// An arena that will only hold a few strings can use smaller chunks.
+// Offsets are 32 bits, so the arena can hold up to 4GB. Dictionary won't load a word
+// list too big for that.
+class StringArena
+{
+public:
+    StringArena()
+        : _base(NULL)
+        , _parent(NULL)
+        , _baseSize(0)
+        , _chunkSize(ARENA_CHUNK_SIZE)
+        , _lastChunkUsed(ARENA_CHUNK_SIZE)
+    {
+    }
+
+    ~StringArena()
+    {
+        for (size_t loop = 0; loop < _chunks.size(); loop++)
+        {
+            delete[] _chunks[loop];
+        }
+    }
+
+    // exchange the contents of this arena and "other"
+    void    Swap(StringArena& other)
+    {
+        swap(_base, other._base);
+        swap(_parent, other._parent);
+        swap(_baseSize, other._baseSize);
+        _chunks.swap(other._chunks);
+        swap(_chunkSize, other._chunkSize);
+        swap(_lastChunkUsed, other._lastChunkUsed);
+    }
+
+    // Use the "size" bytes at "base" as the start of the arena. Doesn't take ownership.
+    // This must be done before anything is added
+    void    SetBase(const char* base, size_t size)
+    {
+        _base = base;
+        _baseSize = (unsigned int)size;
+    }
+
+    // Start the arena with everything in "parent" now, which must outlive it, or with
+    // nothing if it's NULL. Strings added to "parent" later aren't in this arena.
+    // Doesn't take ownership. This must be done before anything is added
+    void    SetParent(const StringArena* parent)
+    {
+        _parent = parent;
+        _baseSize = parent != NULL ? (unsigned int)parent->GetSize() : 0;
+    }
+
+    const StringArena*  GetParent() const
+    {
+        return _parent;
+    }
+
+    // Add strings in chunks of "size" bytes, rounded up to a power of two from
+    // MIN_ARENA_CHUNK_SIZE to ARENA_CHUNK_SIZE. This must be done before anything is added
+    void    SetChunkSize(size_t size)
+    {
+        _chunkSize = MIN_ARENA_CHUNK_SIZE;
+        while (_chunkSize < ARENA_CHUNK_SIZE && _chunkSize < size)
+        {
+            _chunkSize *= 2;
+        }
+        _lastChunkUsed = _chunkSize;
+    }
+
+    unsigned int    GetChunkSize() const
+    {
+        return _chunkSize;
+    }
+
+    // return true if "ref" is a string added to this arena, rather than one in its base
+    // buffer or parent
+    bool    IsAdded(StringRef ref) const
+    {
+        return ref._offset >= _baseSize;
+    }
+
+    // return a reference to the "length" bytes at "str", which are in the base buffer
+    StringRef   GetRef(const char* str, size_t length) const
+    {
+        StringRef ref;
+        ref._offset = (unsigned int)(str - _base);
+        ref._length = (unsigned int)length;
+        return ref;
+    }
+
+    // Append a copy of "str" to the arena
+    StringRef   Add(string_view str)
+    {
+        if (str.size() + 1 > _chunkSize)
+            return AddLong(str);
+
+        if (_lastChunkUsed + str.size() + 1 > _chunkSize)
+        {
+            _chunks.push_back(new char[_chunkSize]);
+            _lastChunkUsed = 0;
+        }
+        char* data = _chunks.back() + _lastChunkUsed;
+        memcpy(data, str.data(), str.size());
+        data[str.size()] = '\0';
+
+        StringRef ref;
+        ref._offset = _baseSize + (unsigned int)((_chunks.size() - 1) * _chunkSize + _lastChunkUsed);
+        ref._length = (unsigned int)str.size();
+        _lastChunkUsed += str.size() + 1;
+        return ref;
+    }
+
+    string_view Get(StringRef ref) const
+    {
+        if (ref._offset < _baseSize)
+        {
+            if (_parent != NULL)
+                return _parent->Get(ref);
+            return string_view(_base + ref._offset, ref._length);
+        }
+        unsigned int offset = ref._offset - _baseSize;
+        return string_view(_chunks[offset / _chunkSize] + offset % _chunkSize, ref._length);
+    }
+
+    // return the number of bytes the arena holds
+    size_t  GetSize() const
+    {
+        return _baseSize + _chunks.size() * _chunkSize;
+    }
+
+    // return the number of bytes held for strings added to the arena
+    size_t  GetAddedSize() const
+    {
+        return _chunks.size() * _chunkSize;
+    }
+
+private:
+    static const unsigned int ARENA_CHUNK_SIZE = 1 << 20;
+    static const unsigned int MIN_ARENA_CHUNK_SIZE = 4 << 10;
+
+    // Add "str", which doesn't fit in a chunk, in a block of whole chunks of its own.
+    // The block is the first of its chunks, and the rest are NULL, so every offset
+    // still finds its chunk by division. Nothing else goes in the block
+    StringRef   AddLong(string_view str)
+    {
+        size_t numChunks = (str.size() + _chunkSize) / _chunkSize;
+        char* data = new char[numChunks * _chunkSize];
+        memcpy(data, str.data(), str.size());
+        data[str.size()] = '\0';
+
+        StringRef ref;
+        ref._offset = _baseSize + (unsigned int)(_chunks.size() * _chunkSize);
+        ref._length = (unsigned int)str.size();
+        _chunks.push_back(data);
+        _chunks.resize(_chunks.size() + numChunks - 1, NULL);
+        _lastChunkUsed = _chunkSize;
+        return ref;
+    }
+
+    const char*         _base;
+    const StringArena*  _parent;
+    unsigned int        _baseSize;      // bytes in _base or _parent
+    unsigned int        _chunkSize;
+    vector<char*>       _chunks;
+    size_t              _lastChunkUsed;
+};
+
+struct KVPair
+{
+    unsigned int _key;
+    StringRef    _value;        // the word, in the dictionary's arena
+};
+
+// StringHash only takes C strings. "word" needn't be NUL terminated, as the words of a
+// mapped file aren't, so it's hashed from a terminated copy
+static unsigned int HashWord(string_view word)
+{
+    char buffer[256];
+    if (word.size() < sizeof(buffer))
+    {
+        memcpy(buffer, word.data(), word.size());
+        buffer[word.size()] = '\0';
+        return StringHash( buffer );
+    }
+    return StringHash( string(word).c_str() );
+}
+
+// Return a mask with bit n set where block[n] is a newline, for the 64 bytes at "block"
+static unsigned long long GetNewlineMaskScalar(const char* block)
+{
+    unsigned long long mask = 0;
+    for (int loop = 0; loop < 64; loop++)
+    {
+        if (block[loop] == '\n')
+        {
+            mask |= 1ull << loop;
+        }
+    }
+    return mask;
+}
+
+#if defined(HAVE_X86_SIMD)
+static unsigned long long GetNewlineMaskSse2(const char* block)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    unsigned long long mask = 0;
+    for (int loop = 0; loop < 64; loop += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(block + loop));
+        mask |= (unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)) << loop;
+    }
+    return mask;
+}
+
+TARGET_AVX2 static unsigned long long GetNewlineMaskAvx2(const char* block)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    __m256i low = _mm256_loadu_si256((const __m256i*)block);
+    __m256i high = _mm256_loadu_si256((const __m256i*)(block + 32));
+    unsigned int lowMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline));
+    unsigned int highMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline));
+    return ((unsigned long long)highMask << 32) | lowMask;
+}
+#endif
+
+// A file mapped into memory, read-only
+class MappedFile
+{
+public:
+    MappedFile()
+        : _data(NULL)
+        , _size(0)
+    {
+    }
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    // Map all of "fileName", read only
+    // return false if the file can't be opened or is empty
+    bool    Open(const char* fileName)
+    {
+        Close();
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        HANDLE mapping = NULL;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+        {
+            _size = (size_t)fileSize.QuadPart;
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        }
+        if (mapping)
+        {
+            _data = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+#else
+        int file = open(fileName, O_RDONLY);
+        if (file < 0)
+            return false;
+        struct stat fileStat;
+        if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0)
+        {
+            _size = (size_t)fileStat.st_size;
+            void* mapping = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (mapping != MAP_FAILED)
+            {
+                _data = (char*)mapping;
+            }
+        }
+        close(file);
+#endif
+        if (_data == NULL)
+        {
+            _size = 0;
+            return false;
+        }
+        return true;
+    }
+
+    void    Close()
+    {
+        if (_data)
+        {
+#if defined(_WIN32)
+            UnmapViewOfFile(_data);
+#else
+            munmap(_data, _size);
+#endif
+            _data = NULL;
+            _size = 0;
+        }
+    }
+
+    const char* GetData() const
+    {
+        return _data;
+    }
+
+    size_t  GetSize() const
+    {
+        return _size;
+    }
+
+    void    Swap(MappedFile& other)
+    {
+        swap(_data, other._data);
+        swap(_size, other._size);
+    }
+
+private:
+    MappedFile(const MappedFile& );
+    MappedFile& operator=(const MappedFile& );
+
+    char*   _data;
+    size_t  _size;
+};
+
+// Set "size" and "modified" to the size of "fileName" and the time it was last written,
+// which is only meant to be compared with another stamp of the same file
+// return false if the file can't be found
+static bool GetFileStamp(const char* fileName, unsigned long long& size, unsigned long long& modified)
+{
+#if defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(fileName, GetFileExInfoStandard, &attributes))
+        return false;
+    size = ((unsigned long long)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+    modified = ((unsigned long long)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat fileStat;
+    if (stat(fileName, &fileStat) != 0)
+        return false;
+    size = (unsigned long long)fileStat.st_size;
+#if defined(__APPLE__)
+    modified = (unsigned long long)fileStat.st_mtimespec.tv_sec * 1000000000ull + fileStat.st_mtimespec.tv_nsec;
+#else
+    modified = (unsigned long long)fileStat.st_mtim.tv_sec * 1000000000ull + fileStat.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+// Class describing the dictionary. It consists of an array of key-value pairs, where
+// the word (value) has been pre-hashed (key)
+// All words are stored here. The hash map classes have access to this data with which
+// to build their own data structures
+// The file is either read into one buffer or mapped into memory, and then split into
+// words in place, so no word is allocated or copied on its own. Words are found by
+// their length, so the buffer is never written to.
+class   Dictionary
+{
+public:
+    Dictionary()
+    {
+    }
+    
+    ~Dictionary()
+    {
+    }
+
+    // Read the dictionary, hash the key string and store in the K-V pair array
+    // return false if the file can't be read or is too big for StringRef offsets
+    bool    ReadFile(const char* fileName)
+    {
+        ifstream myfile(fileName, ios::binary);
+
+        if (myfile.is_open())
+        {
+            myfile.seekg(0, ios::end);
+            unsigned long long size = (unsigned long long)myfile.tellg();
+            myfile.seekg(0, ios::beg);
+            if (!IsSizeAllowed(fileName, size))
+                return false;
+
+            // one spare byte so an empty file still has a buffer
+            _fileBuffer.assign(size + 1, '\0');
+            myfile.read(&_fileBuffer[0], size);
+            ParseWords(&_fileBuffer[0], size);
+        }
+        else
+        {
+            return false;
+        }
+        myfile.close();
+        return true;
+    }
+
+    // As ReadFile, but map the file into memory instead of reading it. The mapping is
+    // read only, so its pages are shared with the page cache and nothing is copied
+    bool    MapFile(const char* fileName)
+    {
+        if (!_mappedFile.Open(fileName))
+            return false;
+        if (!IsSizeAllowed(fileName, _mappedFile.GetSize()))
+        {
+            _mappedFile.Close();
+            return false;
+        }
+
+        ParseWords(_mappedFile.GetData(), _mappedFile.GetSize());
+        return true;
+    }
+
+    const int GetSize() const
+    {
+        return _stringArray.size();
+    }
+
+    const KVPair&   GetKVPair(int index) const
+    {
+        return _stringArray[index];
+    }
+
+    string_view     GetString(int index) const
+    {
+        return _arena.Get(_stringArray[index]._value);
+    }
+
+    StringArena*    GetArena()
+    {
+        return &_arena;
+    }
+
+private:
+    // return false, saying so, if "fileName", of "size" bytes, is too big for the 32-bit
+    // offsets of a StringRef, which would otherwise wrap and find the wrong words
+    static bool IsSizeAllowed(const char* fileName, unsigned long long size)
+    {
+        if (size <= UINT_MAX)
+            return true;
+
+        cout << fileName << " is " << size << " bytes, more than the " << UINT_MAX << " a dictionary can hold" << endl;
+        return false;
+    }
+
+    // Split "buffer" into lines, 64 bytes at a time. The newlines in each block are
+    // found together with SIMD compares and then visited one set bit at a time
+    void    ParseWords(const char* buffer, size_t size)
+    {
+        SimdLevel simdLevel = GetSimdLevel();
+        const char* lineStart = buffer;
+        _arena.SetBase(buffer, size);
+
+        // guess at an average of 8 bytes a line, to save growing as we go
+        _stringArray.reserve(size / 8);
+
+        for (size_t position = 0; position < size; position += 64)
+        {
+            unsigned long long newlines;
+            if (size - position < 64)
+            {
+                // copy the last partial block so the block compare doesn't read past the end
+                char lastBlock[64] = { 0 };
+                memcpy(lastBlock, buffer + position, size - position);
+                newlines = GetNewlineMaskScalar(lastBlock);
+            }
+#if defined(HAVE_X86_SIMD)
+            else if (simdLevel == SIMD_AVX2)
+            {
+                newlines = GetNewlineMaskAvx2(buffer + position);
+            }
+            else if (simdLevel == SIMD_SSE2)
+            {
+                newlines = GetNewlineMaskSse2(buffer + position);
+            }
+#endif
+            else
+            {
+                newlines = GetNewlineMaskScalar(buffer + position);
+            }
+
+            while (newlines)
+            {
+                const char* lineEnd = buffer + position + GetLowestBit64(newlines);
+                AddWord(lineStart, lineEnd);
+                lineStart = lineEnd + 1;
+                newlines &= newlines - 1;
+            }
+        }
+        if (lineStart < buffer + size)
+        {
+            AddWord(lineStart, buffer + size);
+        }
+        InternWords();
+    }
+
+    // Add the line from "start" to "end" as a word, unless it's empty or holds a 0 byte,
+    // which the radix tree uses to end a word
+    void    AddWord(const char* start, const char* end)
+    {
+        if (end > start && end[-1] == '\r')
+        {
+            end--;
+        }
+
+        if (end > start && memchr(start, '\0', end - start) == NULL)
+        {
+            KVPair pair;
+            pair._key = HashWord(string_view(start, end - start));
+            pair._value = _arena.GetRef(start, end - start);
+            _stringArray.push_back(pair);
+        }
+    }
+
+    // Point every repeat of a word at its first copy, so each distinct word is only
+    // referenced once. Uses a throwaway open-addressing table of the first word seen
+    // with each hash
+    void    InternWords()
+    {
+        size_t capacity = 16;
+        while (capacity < _stringArray.size() * 2)
+        {
+            capacity *= 2;
+        }
+        vector<int> firstWords(capacity, -1);
+
+        for (size_t loop = 0; loop < _stringArray.size(); loop++)
+        {
+            KVPair& pair = _stringArray[loop];
+            size_t slot = (size_t)((pair._key * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+            while (firstWords[slot] >= 0)
+            {
+                const KVPair& first = _stringArray[firstWords[slot]];
+                if (first._key == pair._key && _arena.Get(first._value) == _arena.Get(pair._value))
+                {
+                    pair._value = first._value;
+                    break;
+                }
+                slot = (slot + 1) & (capacity - 1);
+            }
+            if (firstWords[slot] < 0)
+            {
+                firstWords[slot] = (int)loop;
+            }
+        }
+    }
+
+    // the KV pairs of words read in
+    vector<KVPair>  _stringArray;
+
+    // where the words live. Either the file read into memory, or mapped into it, and
+    // then the arena over the top of that
+    vector<char>    _fileBuffer;
+    MappedFile      _mappedFile;
+    StringArena     _arena;
+};
+
+// Report the memory used by the words themselves, with and without the shared arena,
+// for the dictionary plus the "numMaps" maps built from it that refer to its arena.
+// Without it, each of them held its own std::string per word: the string itself, and a
+// heap block for any word too long to fit inside it. With it, they hold a StringRef
+// per word into the one arena.
+static void ReportStringMemory(Dictionary* dictionary, int numMaps)
+{
+    int lengthCounts[NUM_WORD_LENGTH_BUCKETS] = { 0 };
+    int size = dictionary->GetSize();
+    size_t inlineCapacity = string().capacity();
+    size_t copyBytes = 0;
+    for (int loop = 0; loop < size; loop++)
+    {
+        size_t length = dictionary->GetString(loop).size();
+        lengthCounts[GetWordLengthBucket(length)]++;
+        copyBytes += sizeof(string) + (length > inlineCapacity ? length + 1 : 0);
+    }
+    size_t arenaBytes = dictionary->GetArena()->GetSize() + (size_t)size * sizeof(StringRef) * (numMaps + 1);
+
+    cout << "String memory for the dictionary and " << numMaps << " maps sharing its arena: "
+         << copyBytes * (numMaps + 1) << " bytes with a copy each, "
+         << arenaBytes << " bytes with the shared arena" << endl;
+
+    cout << "Word lengths:";
+    for (int bucket = 0; bucket < NUM_WORD_LENGTH_BUCKETS; bucket++)
+    {
+        cout << " " << GetWordLengthBucketName(bucket) << " " << 100.0 * lengthCounts[bucket] / max(size, 1) << "%";
+    }
+    cout << endl;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Hash functions
+//
+// The maps take the hash function as a template policy so they can be compared with
+// different ones. A policy has:
+//   Hash(word)             the hash of "word"
+//   HashEntry(kvPair, word) the hash of a dictionary entry, which can reuse the hash the
+//                          dictionary already worked out
+//   Id                     a number identifying the function in saved data
+//   GetName()
+// Hashes are returned as 64 bits whatever their real size.
+
+typedef unsigned long long  HashValue;
+
+// The original hash. StringHash only takes C strings, so a std::string is hashed in
+// place and any other word through HashWord
+struct StringHashPolicy
+{
+    static const unsigned int Id = 0;
+
+    static const char* GetName()
+    {
+        return "StringHash";
+    }
+
+    static HashValue Hash(const string& word)
+    {
+        return (unsigned int)StringHash( word.c_str() );
+    }
+
+    static HashValue Hash(string_view word)
+    {
+        return HashWord(word);
+    }
+
+    static HashValue HashEntry(const KVPair& kvPair, string_view )
+    {
+        return kvPair._key;
+    }
+};
+
+// 64-bit FNV-1a. Simple and byte at a time
+struct Fnv1aHashPolicy
+{
+    static const unsigned int Id = 1;
+
+    static const char* GetName()
+    {
+        return "FNV-1a";
+    }
+
+    static HashValue Hash(string_view word)
+    {
+        unsigned long long hash = 0xcbf29ce484222325ull;
+        for (size_t loop = 0; loop < word.size(); loop++)
+        {
+            hash ^= (unsigned char)word[loop];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    static HashValue HashEntry(const KVPair& , string_view word)
+    {
+        return Hash(word);
+    }
+};
+
+static inline unsigned long long Read64(const char* data)
+{
+    unsigned long long value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline unsigned long long Read32(const char* data)
+{
+    unsigned int value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// 64x64->128 bit multiply, folded back to 64 bits by xoring the halves
+static inline unsigned long long MultiplyFold(unsigned long long a, unsigned long long b)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long long high;
+    unsigned long long low = _umul128(a, b, &high);
+    return low ^ high;
+#else
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (unsigned long long)product ^ (unsigned long long)(product >> 64);
+#endif
+}
+
+// the high 64 bits of the 128-bit product. Maps "a" evenly onto the range [0, b)
+static inline unsigned long long MultiplyHigh(unsigned long long a, unsigned long long b)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    return __umulh(a, b);
+#else
+    return (unsigned long long)(((unsigned __int128)a * b) >> 64);
+#endif
+}
+
+// the splitmix64 finaliser. Every bit of the input affects every bit of the output
+static inline unsigned long long Mix64(unsigned long long value)
+{
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ull;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebull;
+    value ^= value >> 31;
+    return value;
+}
+
+// A wyhash-style 64-bit hash. Reads 8 or 16 bytes at a time and mixes with wide
+// multiplies, so it's much faster than FNV-1a on anything but the shortest words
+struct WyHashPolicy
+{
+    static const unsigned int Id = 2;
+
+    static const char* GetName()
+    {
+        return "wyhash";
+    }
+
+    static HashValue Hash(string_view word)
+    {
+        static const unsigned long long P0 = 0xa0761d6478bd642full;
+        static const unsigned long long P1 = 0xe7037ed1a0b428dbull;
+
+        const char* data = word.data();
+        size_t length = word.size();
+        unsigned long long seed = P0;
+        unsigned long long a;
+        unsigned long long b;
+
+        if (length <= 16)
+        {
+            if (length >= 4)
+            {
+                // two overlapping pairs of 4-byte reads cover 4 to 16 bytes
+                size_t offset = (length >> 3) << 2;
+                a = (Read32(data) << 32) | Read32(data + offset);
+                b = (Read32(data + length - 4) << 32) | Read32(data + length - 4 - offset);
+            }
+            else if (length > 0)
+            {
+                a = ((unsigned long long)(unsigned char)data[0] << 16) | ((unsigned long long)(unsigned char)data[length >> 1] << 8) | (unsigned char)data[length - 1];
+                b = 0;
+            }
+            else
+            {
+                a = 0;
+                b = 0;
+            }
+        }
+        else
+        {
+            size_t remaining = length;
+            while (remaining > 16)
+            {
+                seed = MultiplyFold(Read64(data) ^ P1, Read64(data + 8) ^ seed);
+                data += 16;
+                remaining -= 16;
+            }
+            a = Read64(data + remaining - 16);
+            b = Read64(data + remaining - 8);
+        }
+        return MultiplyFold(P1 ^ length, MultiplyFold(a ^ P1, b ^ seed));
+    }
+
+    static HashValue HashEntry(const KVPair& , string_view word)
+    {
+        return Hash(word);
+    }
+};
+
+// CRC32C table for CPUs without the SSE4.2 crc32 instruction. It's built the first time
+// it's wanted, which may be on several benchmark threads at once, so it's built as a
+// local static, which only one thread can initialise
+static const unsigned int* GetCrc32cTable()
+{
+    static const vector<unsigned int> table = []()
+    {
+        vector<unsigned int> crcs(256);
+        for (unsigned int loop = 0; loop < 256; loop++)
+        {
+            unsigned int crc = loop;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            }
+            crcs[loop] = crc;
+        }
+        return crcs;
+    }();
+    return table.data();
+}
+
+static bool HasCrc32Instruction()
+{
+#if defined(HAVE_X86_SIMD) && defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#elif defined(HAVE_X86_SIMD) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return false;
+#endif
+}
+
+#if defined(HAVE_X86_SIMD)
+#if defined(__GNUC__)
+__attribute__((target("sse4.2")))
+#endif
+static unsigned int Crc32cSse42(const char* data, size_t length)
+{
+    unsigned long long crc = 0xFFFFFFFF;
+#if defined(__x86_64__) || defined(_M_X64)
+    for (; length >= 8; length -= 8, data += 8)
+    {
+        crc = _mm_crc32_u64(crc, Read64(data));
+    }
+#endif
+    unsigned int crc32 = (unsigned int)crc;
+    for (; length > 0; length--, data++)
+    {
+        crc32 = _mm_crc32_u8(crc32, (unsigned char)*data);
+    }
+    return ~crc32;
+}
+#endif
+
+// CRC32C, using the SSE4.2 crc32 instruction to hash 8 bytes at a time when the CPU
+// has it, or a table a byte at a time when it doesn't
+struct Crc32cHashPolicy
+{
+    static const unsigned int Id = 3;
+
+    static const char* GetName()
+    {
+        return "CRC32C";
+    }
+
+    static HashValue Hash(string_view word)
+    {
+#if defined(HAVE_X86_SIMD)
+        static const bool hasCrc32 = HasCrc32Instruction();
+        if (hasCrc32)
+        {
+            return Crc32cSse42(word.data(), word.size());
+        }
+#endif
+        const unsigned int* table = GetCrc32cTable();
+        unsigned int crc = 0xFFFFFFFF;
+        for (size_t loop = 0; loop < word.size(); loop++)
+        {
+            crc = (crc >> 8) ^ table[(crc ^ (unsigned char)word[loop]) & 0xFF];
+        }
+        return ~crc;
+    }
+
+    static HashValue HashEntry(const KVPair& , string_view word)
+    {
+        return Hash(word);
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Workloads
+//
+// The words looked up by the benchmarks. Looking the dictionary up in order is the
+// friendliest possible pattern for the caches and branch predictor, so queries can
+// also be drawn in a shuffled order, uniformly at random or with a Zipf distribution,
+// where a few words make up most of the lookups as in real traffic. A fraction of the
+// queries can be words that aren't in the dictionary. Everything is generated up front
+// from a seed, so a run can be repeated exactly and generating isn't timed.
+
+enum WorkloadOrder
+{
+    WORKLOAD_SEQUENTIAL,    // dictionary order
+    WORKLOAD_SHUFFLED,      // every word once, in a random order
+    WORKLOAD_UNIFORM,       // words picked uniformly at random
+    WORKLOAD_ZIPF,          // the nth most popular word picked with probability ~1/n^s
+};
+
+struct Workload
+{
+    Workload()
+        : _order(WORKLOAD_SEQUENTIAL)
+        , _zipfExponent(1.0)
+        , _missFraction(0.0)
+        , _seed(1)
+    {
+    }
+
+    static const char*  GetOrderName(WorkloadOrder order)
+    {
+        static const char* names[] = { "sequential", "shuffled", "uniform", "zipf" };
+        return names[order];
+    }
+
+    // set _order from its name. return false if there's no order called "name"
+    bool    SetOrder(const char* name)
+    {
+        for (int order = WORKLOAD_SEQUENTIAL; order <= WORKLOAD_ZIPF; order++)
+        {
+            if (strcmp(name, GetOrderName((WorkloadOrder)order)) == 0)
+            {
+                _order = (WorkloadOrder)order;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    string  GetName() const
+    {
+        ostringstream name;
+        name << GetOrderName(_order);
+        if (_order == WORKLOAD_ZIPF)
+        {
+            name << "(" << _zipfExponent << ")";
+        }
+        if (_missFraction > 0.0)
+        {
+            name << ", " << _missFraction * 100.0 << "% misses";
+        }
+        if (_order != WORKLOAD_SEQUENTIAL || _missFraction > 0.0)
+        {
+            name << ", seed " << _seed;
+        }
+        return name.str();
+    }
+
+    WorkloadOrder       _order;
+    double              _zipfExponent;  // s for WORKLOAD_ZIPF
+    double              _missFraction;  // fraction of queries that aren't in the dictionary
+    unsigned long long  _seed;
+};
+
+// SplitMix64. Small, fast and gives the same numbers everywhere for the same seed
+class WorkloadRandom
+{
+public:
+    WorkloadRandom(unsigned long long seed)
+        : _state(seed)
+    {
+    }
+
+    unsigned long long  Next()
+    {
+        _state += 0x9E3779B97F4A7C15ull;
+        return Mix64(_state);
+    }
+
+    // return a number from 0 to "count" - 1
+    size_t  NextIndex(size_t count)
+    {
+        return (size_t)MultiplyHigh(Next(), count);
+    }
+
+    // return a number from 0 up to but not including 1
+    double  NextDouble()
+    {
+        return (Next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    unsigned long long  _state;
+};
+
+// Fill "words" with the queries for "workload". Sequential queries with no misses are
+// just the dictionary's words, looked up round and round; any other workload makes
+// NUM_ITERATIONS queries.
+// A missing word is a dictionary word with one letter changed, or one added if every
+// change gives another word, so it looks like the words around it. Its hash, and so
+// the shard it is looked for in, is unrelated to the word's
+static void GenerateQueries(Dictionary* dictionary, const Workload& workload, vector<string>& words)
+{
+    int size = dictionary->GetSize();
+    WorkloadRandom  random(workload._seed);
+
+    // which dictionary word each query looks up
+    vector<int> indices;
+    if (workload._order == WORKLOAD_SEQUENTIAL)
+    {
+        int count = workload._missFraction > 0.0 ? NUM_ITERATIONS : size;
+        for (int loop = 0; loop < count; loop++)
+        {
+            indices.push_back(loop % size);
+        }
+    }
+    else if (workload._order == WORKLOAD_SHUFFLED)
+    {
+        for (int loop = 0; loop < NUM_ITERATIONS; loop += size)
+        {
+            vector<int> order(size);
+            for (int word = 0; word < size; word++)
+            {
+                order[word] = word;
+            }
+            for (int word = size - 1; word > 0; word--)
+            {
+                swap(order[word], order[random.NextIndex(word + 1)]);
+            }
+            indices.insert(indices.end(), order.begin(), order.begin() + min(size, NUM_ITERATIONS - loop));
+        }
+    }
+    else if (workload._order == WORKLOAD_UNIFORM)
+    {
+        for (int loop = 0; loop < NUM_ITERATIONS; loop++)
+        {
+            indices.push_back((int)random.NextIndex(size));
+        }
+    }
+    else
+    {
+        // give the words their popularity ranks in a random order, so the popular ones
+        // are spread over the dictionary, then pick ranks from the cumulative distribution
+        vector<int> ranked(size);
+        for (int word = 0; word < size; word++)
+        {
+            ranked[word] = word;
+        }
+        for (int word = size - 1; word > 0; word--)
+        {
+            swap(ranked[word], ranked[random.NextIndex(word + 1)]);
+        }
+        vector<double>  cumulative(size);
+        double total = 0.0;
+        for (int rank = 0; rank < size; rank++)
+        {
+            total += 1.0 / pow(rank + 1.0, workload._zipfExponent);
+            cumulative[rank] = total;
+        }
+        for (int loop = 0; loop < NUM_ITERATIONS; loop++)
+        {
+            double target = random.NextDouble() * total;
+            int rank = (int)(upper_bound(cumulative.begin(), cumulative.end(), target) - cumulative.begin());
+            indices.push_back(ranked[min(rank, size - 1)]);
+        }
+    }
+
+    unordered_set<string_view>  dictionaryWords;
+    if (workload._missFraction > 0.0)
+    {
+        dictionaryWords.reserve(size);
+        for (int loop = 0; loop < size; loop++)
+        {
+            dictionaryWords.insert(dictionary->GetString(loop));
+        }
+    }
+
+    words.resize(indices.size());
+    for (size_t loop = 0; loop < indices.size(); loop++)
+    {
+        words[loop] = dictionary->GetString(indices[loop]);
+        if (workload._missFraction > 0.0 && random.NextDouble() < workload._missFraction)
+        {
+            string& word = words[loop];
+            string original = word;
+            for (int attempt = 0; attempt < 8 && dictionaryWords.count(word); attempt++)
+            {
+                word = original;
+                size_t position = word.size() > 1 ? 1 + random.NextIndex(word.size() - 1) : 0;
+                word[position] = (char)('a' + random.NextIndex(NUM_LETTERS));
+            }
+            while (dictionaryWords.count(word))
+            {
+                word += (char)('a' + random.NextIndex(NUM_LETTERS));
+            }
+        }
+    }
+}
+
+// the workload every map starts with, set from the command line
+static Workload g_defaultWorkload;
+
+// A word in a map keyed by its hash. Words that share a hash are chained after the
+// first through a list of overflow entries kept alongside the map, so every word is
+// stored, and checked with a full compare, in the map itself
+struct WordEntry
+{
+    StringRef       _word;
+    unsigned int    _fingerprint;   // HashMapBase::GetFingerprint of the word
+    int             _next;          // next word with the same hash in the overflow list, -1 if none
+};
+
+// The maps of words by hash in the tree based maps. Their nodes come from a memory
+// resource owned by the map, so they're packed together in a few large blocks that
+// are freed all at once, instead of being a heap block each
+typedef pmr::map<HashValue, WordEntry>  WordMap;
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Bucket sizing policies
+//
+// How HashMap picks its number of buckets and turns a hash into a bucket index. Each
+// policy provides:
+//   GetName()                      - short name used in results
+//   GetBucketCount(wanted)         - the bucket count to use when about "wanted" are wanted
+//   GetBucketIndex(hash, count)    - the bucket for "hash" in a table of "count" buckets
+
+// A prime number of buckets, indexed by the remainder, which is an integer division
+// on every lookup
+struct PrimeSizingPolicy
+{
+    static const char*  GetName()
+    {
+        return "prime";
+    }
+
+    static int  GetBucketCount(int wanted)
+    {
+        return GetNearestPrimeNumberTo(wanted);
+    }
+
+    static size_t   GetBucketIndex(HashValue hash, size_t count)
+    {
+        return hash % count;
+    }
+};
+
+// A power of two number of buckets, indexed by a mask. The hash is first multiplied
+// by 2^64/phi and the mask taken from the middle of the product, so hashes that only
+// differ in their high bits still spread over the table
+struct PowerOfTwoSizingPolicy
+{
+    static const char*  GetName()
+    {
+        return "pow2";
+    }
+
+    static int  GetBucketCount(int wanted)
+    {
+        int count = 1;
+        while (count < wanted)
+        {
+            count <<= 1;
+        }
+        return count;
+    }
+
+    static size_t   GetBucketIndex(HashValue hash, size_t count)
+    {
+        return ((hash * 0x9E3779B97F4A7C15ull) >> 32) & (count - 1);
+    }
+};
+
+// Any number of buckets, indexed by Lemire's multiply-shift range reduction: the high
+// half of the mixed hash times the bucket count. A multiply instead of a division
+struct LemireSizingPolicy
+{
+    static const char*  GetName()
+    {
+        return "lemire";
+    }
+
+    static int  GetBucketCount(int wanted)
+    {
+        return max(wanted, 1);
+    }
+
+    static size_t   GetBucketIndex(HashValue hash, size_t count)
+    {
+        return (size_t)MultiplyHigh(hash * 0x9E3779B97F4A7C15ull, count);
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Word storage policies
+//
+// How RobinHoodMap and SwissMap keep the word in each slot, to check a hash match
+// against. Each policy provides:
+//   GetName()                      - short name used in results
+//   Value                          - what a slot holds
+//   Store(arena, ref)              - the Value for the word "ref", which is in "arena"
+//   IsWord(arena, value, word)     - whether "value" is "word"
+//   Move(from, to, value)          - "value" with any word it keeps that was added to
+//                                    "from" copied to "to"
+
+// A StringRef into the arena. Small, but checking a match reads the word from the
+// arena, which is almost always another cache miss
+struct ArenaWordStorage
+{
+    typedef StringRef   Value;
+
+    static const bool   REFERS_TO_ARENA = true;
+
+    static const char*  GetName()
+    {
+        return "arena";
+    }
+
+    static Value    Store(const StringArena* , StringRef ref)
+    {
+        return ref;
+    }
+
+    static bool IsWord(const StringArena* arena, const Value& value, string_view word)
+    {
+        return arena->Get(value) == word;
+    }
+
+    static Value    Move(const StringArena* from, StringArena* to, const Value& value)
+    {
+        if (!from->IsAdded(value))
+            return value;
+        return to->Add(from->Get(value));
+    }
+
+    // set "ref" to where the word of "value" is in the arena
+    // return false if the word is kept in the value itself
+    static bool GetRef(const Value& value, StringRef& ref)
+    {
+        ref = value;
+        return true;
+    }
+};
+
+// Words of up to "Size" - 1 bytes are kept in the slot itself after their length, so
+// checking a match reads nothing else. Longer words are left in the arena, and their
+// StringRef kept instead.
+template <int Size = 24>
+struct InlineWordStorage
+{
+    static_assert(Size > (int)sizeof(StringRef) && Size < 256, "Size must leave room for a StringRef and fit the length in a byte");
+
+    static const unsigned int   MAX_INLINE_LENGTH = Size - 1;
+    static const unsigned char  LONG_WORD = 0xff;       // the length of a word in the arena
+    static const bool           REFERS_TO_ARENA = false;    // only for the few long words
+
+    struct Value
+    {
+        unsigned char   _length;
+        char            _chars[Size - 1];       // the word, or the StringRef of a long one
+    };
+
+    static const char*  GetName()
+    {
+        static const string name = "inline " + to_string(MAX_INLINE_LENGTH);
+        return name.c_str();
+    }
+
+    static Value    Store(const StringArena* arena, StringRef ref)
+    {
+        Value value;
+        if (ref._length <= MAX_INLINE_LENGTH)
+        {
+            value._length = (unsigned char)ref._length;
+            memcpy(value._chars, arena->Get(ref).data(), ref._length);
+        }
+        else
+        {
+            value._length = LONG_WORD;
+            memcpy(value._chars, &ref, sizeof(ref));
+        }
+        return value;
+    }
+
+    static bool IsWord(const StringArena* arena, const Value& value, string_view word)
+    {
+        if (value._length != LONG_WORD)
+        {
+            return value._length == word.size() && memcmp(value._chars, word.data(), word.size()) == 0;
+        }
+        StringRef ref;
+        memcpy(&ref, value._chars, sizeof(ref));
+        return arena->Get(ref) == word;
+    }
+
+    static Value    Move(const StringArena* from, StringArena* to, const Value& value)
+    {
+        if (value._length != LONG_WORD)
+            return value;
+
+        StringRef ref;
+        memcpy(&ref, value._chars, sizeof(ref));
+        if (!from->IsAdded(ref))
+            return value;
+        return Store(to, to->Add(from->Get(ref)));
+    }
+
+    static bool GetRef(const Value& value, StringRef& ref)
+    {
+        if (value._length != LONG_WORD)
+            return false;
+
+        memcpy(&ref, value._chars, sizeof(ref));
+        return true;
+    }
+};
+
+// base class for hash map. Will handle all common functionality between the different
+// Hash map derived classes
+// It also has the helpers the tree-based maps use to store words keyed by hash, where
+// words that share a hash are chained in place and every match is checked in full
+class   HashMapBase
+{
+public:
+    HashMapBase()
+        : _arena(&_ownArena)
+        , _erasedArenaBytes(0)
+        , _minCompactArenaSize(MIN_COMPACT_ARENA_SIZE)
+        , _workload(g_defaultWorkload)
+    {
+    }
+
+    virtual ~HashMapBase()
+    {
+    }
+
+    virtual void CreateMap(Dictionary* ) = 0;
+    virtual bool Find(const string& ) const = 0;
+
+    // Find, with the hash of the word already calculated
+    virtual bool FindHashed(HashValue , const string& ) const = 0;
+
+    // the hash of "word", using the map's hash function
+    virtual HashValue GetHash(const string& ) const = 0;
+
+    // Start loading the memory FindHashed will touch first for this word, without
+    // waiting for it
+    virtual void Prefetch(HashValue , const string& ) const
+    {
+    }
+
+    // Look up "count" words, setting found[n] to whether words[n] is in the map.
+    // Words are taken in groups of up to MAX_BATCH_SIZE. Every word in a group is hashed
+    // and has its bucket prefetched before any of them is probed, so the cache misses
+    // for the whole group are waited for together rather than one after another.
+    // return the number of words found
+    virtual int FindBatch(const string* words, int count, bool* found) const
+    {
+        return FindBatchWith(VirtualLookup(this), words, count, found);
+    }
+
+    virtual const char* GetName() const = 0;
+
+    // return true if the map refers to the words by StringRefs into the dictionary's
+    // arena, rather than keeping its own copies of them
+    virtual bool RefersToDictionaryArena() const
+    {
+        return true;
+    }
+
+    // the time in ms of each phase of CreateMap, in order. Only kept when built with
+    // INSTRUMENT_MAPS
+    const vector< pair<string, double> >&   GetBuildPhases() const
+    {
+        return _buildMs;
+    }
+
+    // the queries RunTest, RunBatchTest and RunThreadedTest look up
+    void    SetWorkload(const Workload& workload)
+    {
+        _workload = workload;
+    }
+
+    // Size the map's own arena for a map expected to have about "wordBytes" of words
+    // inserted, as one of many small maps, with chunks that size and compaction put off
+    // until "minCompactSize" bytes of words are erased. Call before inserting words
+    void    SetArenaSizes(size_t wordBytes, size_t minCompactSize)
+    {
+        _ownArena.SetChunkSize(wordBytes);
+        _minCompactArenaSize = minCompactSize;
+    }
+
+    // Time NUM_ITERATIONS lookups over the dictionary. After NUM_WARMUP_RUNS untimed
+    // passes, each of NUM_TRIALS trials makes one pass timed as a whole, for throughput,
+    // and a second pass timing every lookup, for the latency distribution. Timing each
+    // lookup adds a little to it, so the two are kept apart.
+    BenchmarkResult RunTest(Dictionary* dictionary)
+    {
+        BenchmarkResult result;
+        result._name = GetName();
+        result._workload = _workload.GetName();
+        result._iterations = NUM_ITERATIONS;
+
+        vector<string>  words;
+        GenerateQueries(dictionary, _workload, words);
+
+        for (int run = 0; run < NUM_WARMUP_RUNS; run++)
+        {
+            RunLookups(words, NULL);
+        }
+
+        INSTRUMENT(g_lookupStats.Reset();)
+#if defined(INSTRUMENT_MAPS) && defined(__linux__)
+        HardwareCounters counters;
+#endif
+        for (int trial = 0; trial < NUM_TRIALS; trial++)
+        {
+#if defined(INSTRUMENT_MAPS) && defined(__linux__)
+            if (counters.IsOpen())
+            {
+                counters.Start();
+            }
+#endif
+            chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+            result._found = RunLookups(words, NULL);
+            chrono::steady_clock::duration endTime = chrono::steady_clock::now() - startTime;
+            result._trialMs.push_back(chrono::duration<double, milli>(endTime).count());
+#if defined(INSTRUMENT_MAPS) && defined(__linux__)
+            if (counters.IsOpen())
+            {
+                counters.Stop();
+            }
+#endif
+
+            RunLookups(words, &result._latency, result._hitLatency);
+        }
+
+        INSTRUMENT(result._lookupStats = g_lookupStats;)
+        INSTRUMENT(result._buildMs = _buildMs;)
+#if defined(INSTRUMENT_MAPS) && defined(__linux__)
+        unsigned long long counts[NUM_HARDWARE_COUNTERS];
+        if (counters.IsOpen() && counters.Read(counts))
+        {
+            for (int loop = 0; loop < NUM_HARDWARE_COUNTERS; loop++)
+            {
+                result._perLookup[loop] = (double)counts[loop] / ((double)NUM_TRIALS * NUM_ITERATIONS);
+            }
+        }
+#endif
+
+        double nsPerTick = GetNanosecondsPerTick();
+        const LatencyHistogram& latency = result._latency;
+        cout << *min_element(result._trialMs.begin(), result._trialMs.end()) << "ms"
+             << " to test map (found " << result._found << "/" << NUM_ITERATIONS << ")"
+             << " p50 " << latency.GetPercentile(50.0) * nsPerTick << "ns"
+             << " p99 " << latency.GetPercentile(99.0) * nsPerTick << "ns"
+             << " p99.9 " << latency.GetPercentile(99.9) * nsPerTick << "ns"
+             << " max " << latency.GetMax() * nsPerTick << "ns" << endl;
+        cout << "  hit p50 by length:";
+        for (int bucket = 0; bucket < NUM_WORD_LENGTH_BUCKETS; bucket++)
+        {
+            if (result._hitLatency[bucket].GetCount() > 0)
+            {
+                cout << " " << GetWordLengthBucketName(bucket) << " " << result._hitLatency[bucket].GetPercentile(50.0) * nsPerTick << "ns";
+            }
+        }
+        cout << endl;
+        PrintInstrumentation(result);
+        return result;
+    }
+
+    // Time NUM_ITERATIONS lookups through FindBatch, for each of the sizes in
+    // BATCH_SIZES, and report the speedup of each over a batch of 1
+    void    RunBatchTest(Dictionary* dictionary, BenchmarkResult& result)
+    {
+        vector<string>  words;
+        GenerateQueries(dictionary, _workload, words);
+        int size = words.size();
+        bool found[MAX_BATCH_SIZE];
+
+        for (size_t sizeIndex = 0; sizeIndex < sizeof(BATCH_SIZES) / sizeof(BATCH_SIZES[0]); sizeIndex++)
+        {
+            int batchSize = BATCH_SIZES[sizeIndex];
+            double bestMs = 0.0;
+            int foundCount = 0;
+
+            for (int trial = -NUM_WARMUP_RUNS; trial < NUM_TRIALS; trial++)
+            {
+                foundCount = 0;
+                chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+                int index = 0;
+                for (int done = 0; done < NUM_ITERATIONS; )
+                {
+                    // don't let a batch run off the end of the word list
+                    int count = min(min(batchSize, NUM_ITERATIONS - done), size - index);
+                    foundCount += FindBatch(&words[index], count, found);
+                    done += count;
+                    index = (index + count) % size;
+                }
+                chrono::steady_clock::duration endTime = chrono::steady_clock::now() - startTime;
+                double ms = chrono::duration<double, milli>(endTime).count();
+                if (trial >= 0 && (trial == 0 || ms < bestMs))
+                {
+                    bestMs = ms;
+                }
+            }
+
+            result._batchMs.push_back(make_pair(batchSize, bestMs));
+            cout << "  batch " << batchSize << ": " << bestMs << "ms (found " << foundCount << "/" << NUM_ITERATIONS << ")"
+                 << ", " << result._batchMs[0].second / bestMs << "x batch 1" << endl;
+        }
+    }
+
+    // Time NUM_ITERATIONS lookups of words that aren't in the map: the dictionary's
+    // words with '~' added until they aren't in it, from GetMissingWords. The best of
+    // NUM_TRIALS is kept in the result
+    void    RunMissTest(Dictionary* dictionary, BenchmarkResult& result) const
+    {
+        vector<string>  words;
+        GetMissingWords(dictionary, words);
+        for (int run = 0; run < NUM_WARMUP_RUNS; run++)
+        {
+            RunLookups(words, NULL);
+        }
+
+        int found = 0;
+        for (int trial = 0; trial < NUM_TRIALS; trial++)
+        {
+            chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+            found = RunLookups(words, NULL);
+            chrono::steady_clock::duration endTime = chrono::steady_clock::now() - startTime;
+            double ms = chrono::duration<double, milli>(endTime).count();
+            if (trial == 0 || ms < result._missMs)
+            {
+                result._missMs = ms;
+            }
+        }
+        cout << result._missMs << "ms for " << NUM_ITERATIONS << " missing words (found " << found << ")" << endl;
+    }
+
+    // Fill "words" with the dictionary's words with '~' added, as many as it takes for
+    // none of them to be in it. The words can hold any bytes, so a word with one '~'
+    // added may be another word
+    static void GetMissingWords(Dictionary* dictionary, vector<string>& words)
+    {
+        int size = dictionary->GetSize();
+        unordered_set<string_view>  dictionaryWords;
+        dictionaryWords.reserve(size);
+        for (int loop = 0; loop < size; loop++)
+        {
+            dictionaryWords.insert(dictionary->GetString(loop));
+        }
+
+        GetQueryWords(dictionary, words);
+        for (size_t loop = 0; loop < words.size(); loop++)
+        {
+            do
+            {
+                words[loop] += '~';
+            } while (dictionaryWords.count(words[loop]));
+        }
+    }
+
+    // Time NUM_ITERATIONS lookups on each of 1, 2, 4... threads up to the number of
+    // CPUs available, all sharing this map. Each thread is pinned to its own CPU, looks
+    // up its own copy of the words starting at a different place, and keeps its counts
+    // in its own ThreadResult, so nothing is shared but the map. Reports the total
+    // lookups per second across all threads and the spread of per-thread latencies.
+    void    RunThreadedTest(Dictionary* dictionary, BenchmarkResult& result) const
+    {
+        vector<string>  words;
+        GenerateQueries(dictionary, _workload, words);
+        int size = words.size();
+        int maxThreads = GetAvailableCpus().size();
+        double nsPerTick = GetNanosecondsPerTick();
+
+        for (int numThreads = 1; ; numThreads = min(numThreads * 2, maxThreads))
+        {
+            vector<ThreadResult>    threadResults(numThreads);
+            StartGate               startGate(numThreads);
+
+            vector<thread>  threads;
+            for (int threadIndex = 0; threadIndex < numThreads; threadIndex++)
+            {
+                threads.push_back(thread([&, threadIndex]()
+                {
+                    PinThreadToCpu(threadIndex);
+                    ThreadResult& threadResult = threadResults[threadIndex];
+
+                    // copied on this thread so the words are in memory near its CPU
+                    int first = (int)((long long)size * threadIndex / numThreads);
+                    vector<string>  threadWords(words.begin() + first, words.end());
+                    threadWords.insert(threadWords.end(), words.begin(), words.begin() + first);
+                    RunLookups(threadWords, NULL);
+
+                    startGate.Wait();
+                    threadResult._startTime = chrono::steady_clock::now();
+                    threadResult._found = RunLookups(threadWords, NULL);
+                    threadResult._endTime = chrono::steady_clock::now();
+
+                    RunLookups(threadWords, &threadResult._latency);
+                }));
+            }
+            for (int threadIndex = 0; threadIndex < numThreads; threadIndex++)
+            {
+                threads[threadIndex].join();
+            }
+
+            // throughput is over the time from the first thread starting to the last
+            // one finishing
+            chrono::steady_clock::time_point startTime = threadResults[0]._startTime;
+            chrono::steady_clock::time_point endTime = threadResults[0]._endTime;
+            LatencyHistogram    latency;
+            double worstP99 = 0.0;
+            bool allFound = true;
+            for (int threadIndex = 0; threadIndex < numThreads; threadIndex++)
+            {
+                const ThreadResult& threadResult = threadResults[threadIndex];
+                startTime = min(startTime, threadResult._startTime);
+                endTime = max(endTime, threadResult._endTime);
+                latency.Merge(threadResult._latency);
+                worstP99 = max(worstP99, threadResult._latency.GetPercentile(99.0) * nsPerTick);
+                allFound = allFound && threadResult._found == threadResults[0]._found;
+            }
+            double seconds = chrono::duration<double>(endTime - startTime).count();
+            double lookupsPerSecond = (double)NUM_ITERATIONS * numThreads / seconds;
+            result._threadLookupsPerSecond.push_back(make_pair(numThreads, lookupsPerSecond));
+
+            cout << "  " << numThreads << " threads: " << lookupsPerSecond / 1e6 << "M lookups/s"
+                 << ", " << lookupsPerSecond / result._threadLookupsPerSecond[0].second << "x 1 thread"
+                 << ", p50 " << latency.GetPercentile(50.0) * nsPerTick << "ns"
+                 << " p99 " << latency.GetPercentile(99.0) * nsPerTick << "ns"
+                 << ", worst thread p99 " << worstP99 << "ns"
+                 << (allFound ? "" : " (threads found different counts)") << endl;
+
+            if (numThreads == maxThreads)
+                break;
+        }
+    }
+
+protected:
+    // Copy the dictionary's words out as the queries to look up, so building the
+    // strings to pass to Find isn't part of what's timed
+    static void GetQueryWords(Dictionary* dictionary, vector<string>& words)
+    {
+        int size = dictionary->GetSize();
+        words.resize(size);
+        for (int loop = 0; loop < size; loop++)
+        {
+            words[loop] = dictionary->GetString(loop);
+        }
+    }
+
+    // Look up NUM_ITERATIONS words in order, recording the latency of each in
+    // "latency" if it isn't NULL. If "hitLatency" isn't NULL either, the latency of
+    // each word found is also recorded in the bucket for its length.
+    // return the number found
+    virtual int RunLookups(const vector<string>& words, LatencyHistogram* latency, LatencyHistogram* hitLatency = NULL) const
+    {
+        return RunLookupsWith(VirtualLookup(this), words, latency, hitLatency);
+    }
+
+    // The lookups made by the benchmark loops, through the vtable.
+    // See StaticDispatch for the ones that aren't
+    class VirtualLookup
+    {
+    public:
+        explicit VirtualLookup(const HashMapBase* map)
+            : _map(map)
+        {
+        }
+
+        bool        Find(const string& word) const                  { return _map->Find(word); }
+        bool        FindHashed(HashValue key, const string& word) const { return _map->FindHashed(key, word); }
+        HashValue   GetHash(const string& word) const               { return _map->GetHash(word); }
+        void        Prefetch(HashValue key, const string& word) const   { _map->Prefetch(key, word); }
+
+    private:
+        const HashMapBase*  _map;
+    };
+
+    // FindBatch, making its lookups with "lookup"
+    template <class Lookup>
+    static int  FindBatchWith(const Lookup& lookup, const string* words, int count, bool* found)
+    {
+        HashValue   keys[MAX_BATCH_SIZE];
+        int foundCount = 0;
+
+        for (int first = 0; first < count; first += MAX_BATCH_SIZE)
+        {
+            int batchSize = min(count - first, MAX_BATCH_SIZE);
+            for (int loop = 0; loop < batchSize; loop++)
+            {
+                keys[loop] = lookup.GetHash(words[first + loop]);
+                lookup.Prefetch(keys[loop], words[first + loop]);
+            }
+            for (int loop = 0; loop < batchSize; loop++)
+            {
+                found[first + loop] = lookup.FindHashed(keys[loop], words[first + loop]);
+                if (found[first + loop])
+                {
+                    foundCount++;
+                }
+            }
+        }
+        return foundCount;
+    }
+
+    // RunLookups, making its lookups with "lookup"
+    template <class Lookup>
+    static int  RunLookupsWith(const Lookup& lookup, const vector<string>& words, LatencyHistogram* latency, LatencyHistogram* hitLatency)
+    {
+        int foundCount = 0;
+        int size = words.size();
+
+        for (int loop = 0; loop < NUM_ITERATIONS; loop++)
+        {
+            int index = loop % size;
+            const string& word = words[index];
+            if (latency)
+            {
+                unsigned long long startTicks = ReadTicks();
+                bool found = lookup.Find(word);
+                unsigned long long ticks = ReadTicks() - startTicks;
+                latency->Record(ticks);
+                if (found)
+                {
+                    foundCount++;
+                    if (hitLatency)
+                    {
+                        hitLatency[GetWordLengthBucket(word.size())].Record(ticks);
+                    }
+                }
+            }
+            else if (lookup.Find(word))
+            {
+                foundCount++;
+            }
+        }
+        INSTRUMENT(g_lookupStats.AddLookups(NUM_ITERATIONS);)
+        return foundCount;
+    }
+
+    // The sharded maps split the words into 1 << "shardBits" shards by the top bits of
+    // their mixed hash, which spreads any words evenly, whatever bytes they start with.
+    // This is the shard "key" is in. It shifts in two steps so that a single shard
+    // doesn't shift by 64
+    static size_t   GetShardIndex(HashValue key, int shardBits)
+    {
+        return (size_t)((Mix64(key) >> 1) >> (63 - shardBits));
+    }
+
+    // the bits needed for "numShards" shards, rounded up to a power of two
+    static int  GetShardBits(int numShards)
+    {
+        int bits = 0;
+        while (bits < MAX_SHARD_BITS && (1 << bits) < numShards)
+        {
+            bits++;
+        }
+        return bits;
+    }
+
+    // a dictionary word in a shard's partition, with the hash it was partitioned by so
+    // building the shard doesn't hash it again
+    struct PartitionWord
+    {
+        int         _index;
+        HashValue   _hash;
+    };
+
+    typedef vector< vector<PartitionWord> > Partitions;
+
+    // Split the dictionary's words into the 1 << "shardBits" shards of GetShardIndex, in
+    // parallel on "pool". Each partition gets its shard's words in dictionary order, so
+    // it is built exactly as it would be from one pass over the dictionary
+    template <class Hash>
+    static void PartitionByShard(Dictionary* dictionary, WorkStealingPool& pool, int shardBits, Partitions& partitions)
+    {
+        PartitionByShard<Hash>(dictionary, pool, 1 << shardBits, [shardBits](HashValue key) { return GetShardIndex(key, shardBits); }, partitions);
+    }
+
+    // Split the dictionary's words into "numShards" shards, picking each word's shard
+    // by calling "shardIndex" with its hash
+    template <class Hash, class ShardIndex>
+    static void PartitionByShard(Dictionary* dictionary, WorkStealingPool& pool, int numShards, ShardIndex shardIndex, Partitions& partitions)
+    {
+        int size = dictionary->GetSize();
+        int numChunks = pool.GetThreadCount();
+        vector<Partitions>  chunkPartitions(numChunks, Partitions(numShards));
+        vector< function<void()> > tasks;
+        for (int chunk = 0; chunk < numChunks; chunk++)
+        {
+            tasks.push_back([dictionary, size, numChunks, chunk, &shardIndex, &chunkPartitions]()
+            {
+                int first = (int)((long long)size * chunk / numChunks);
+                int last = (int)((long long)size * (chunk + 1) / numChunks);
+                Partitions& shards = chunkPartitions[chunk];
+                for (int loop = first; loop < last; loop++)
+                {
+                    PartitionWord word;
+                    word._index = loop;
+                    word._hash = Hash::HashEntry(dictionary->GetKVPair(loop), dictionary->GetString(loop));
+                    shards[shardIndex(word._hash)].push_back(word);
+                }
+            });
+        }
+        pool.Run(tasks);
+
+        partitions.assign(numShards, vector<PartitionWord>());
+        for (int shard = 0; shard < numShards; shard++)
+        {
+            size_t count = 0;
+            for (int chunk = 0; chunk < numChunks; chunk++)
+            {
+                count += chunkPartitions[chunk][shard].size();
+            }
+            partitions[shard].reserve(count);
+            for (int chunk = 0; chunk < numChunks; chunk++)
+            {
+                const vector<PartitionWord>& words = chunkPartitions[chunk][shard];
+                partitions[shard].insert(partitions[shard].end(), words.begin(), words.end());
+            }
+        }
+    }
+
+    // Fill "shards" with the shards ordered by the size of their partition, biggest
+    // first, so the biggest are started first
+    static void OrderBySize(const Partitions& partitions, vector<int>& shards)
+    {
+        shards.resize(partitions.size());
+        for (size_t loop = 0; loop < partitions.size(); loop++)
+        {
+            shards[loop] = (int)loop;
+        }
+        sort(shards.begin(), shards.end(), [&partitions](int a, int b) { return partitions[a].size() > partitions[b].size(); });
+    }
+
+    // Print the words in each shard of "partitions", and how far the biggest is from
+    // the mean
+    static void ReportShardOccupancy(const Partitions& partitions)
+    {
+        size_t smallest = partitions[0].size();
+        size_t largest = 0;
+        size_t total = 0;
+        cout << "Words per shard:";
+        for (size_t loop = 0; loop < partitions.size(); loop++)
+        {
+            size_t count = partitions[loop].size();
+            smallest = min(smallest, count);
+            largest = max(largest, count);
+            total += count;
+            cout << " " << count;
+        }
+        double mean = (double)total / partitions.size();
+        cout << endl;
+        cout << partitions.size() << " shards: " << smallest << " to " << largest << " words, the largest "
+             << (mean > 0.0 ? largest / mean : 0.0) << "x the mean" << endl;
+    }
+
+    // End the phase of CreateMap in progress, if there is one, adding its time to
+    // _buildMs, and start timing the one called "name". NULL just ends it
+    void    StartBuildPhase(const char* name)
+    {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        if (!_buildPhase.empty())
+        {
+            _buildMs.push_back(make_pair(_buildPhase, chrono::duration<double, milli>(now - _buildPhaseStart).count()));
+        }
+        _buildPhase = name ? name : "";
+        _buildPhaseStart = now;
+    }
+
+    // A second hash of "word", made from its length and its first and last few bytes.
+    // It's independent of the map's hash, so words that share a hash can almost always
+    // be told apart without fetching the stored word to compare it
+    static unsigned int GetFingerprint(string_view word)
+    {
+        size_t length = word.size();
+        unsigned long long value = length;
+        if (length >= 4)
+        {
+            value ^= (Read32(word.data()) << 32) | Read32(word.data() + length - 4);
+        }
+        else
+        {
+            for (size_t loop = 0; loop < length; loop++)
+            {
+                value ^= (unsigned long long)(unsigned char)word[loop] << (8 * loop + 8);
+            }
+        }
+        return (unsigned int)((value * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    // return true if "entry" holds "word", whose fingerprint is "fingerprint"
+    bool    IsWord(const WordEntry& entry, string_view word, unsigned int fingerprint) const
+    {
+        return entry._word._length == word.size() && entry._fingerprint == fingerprint &&
+               memcmp(_arena->Get(entry._word).data(), word.data(), word.size()) == 0;
+    }
+
+    // return true if "word", whose hash is "key", is in "wordMap" or chained from it
+    // through "overflow"
+    bool    FindWord(const WordMap& wordMap, const vector<WordEntry>& overflow, HashValue key, string_view word) const
+    {
+        WordMap::const_iterator it = wordMap.find(key);
+        if (it == wordMap.end())
+            return false;
+
+        unsigned int fingerprint = GetFingerprint(word);
+        for (const WordEntry* entry = &it->second; ; entry = &overflow[entry->_next])
+        {
+            if (IsWord(*entry, word, fingerprint))
+                return true;
+            if (entry->_next < 0)
+                return false;
+            INSTRUMENT(if (entry == &it->second) g_lookupStats.RecordChained();)
+        }
+    }
+
+    // Add the word "value", whose hash is "key", to "wordMap". If another word already
+    // has that hash, it's chained after that word through "overflow"
+    // return true if it was added, false if it was already there
+    bool    AddWord(WordMap& wordMap, vector<WordEntry>& overflow, HashValue key, StringRef value)
+    {
+        string_view word = _arena->Get(value);
+        WordEntry   entry;
+        entry._word = value;
+        entry._fingerprint = GetFingerprint(word);
+        entry._next = -1;
+
+        pair<WordMap::iterator, bool> inserted = wordMap.insert(make_pair(key, entry));
+        if (inserted.second)
+            return true;
+        if (FindWord(wordMap, overflow, key, word))
+            return false;
+
+        entry._next = inserted.first->second._next;
+        inserted.first->second._next = overflow.size();
+        overflow.push_back(entry);
+        return true;
+    }
+
+    // Remove "word", whose hash is "key", from "wordMap", and set "erased" to where its
+    // word was stored. Its entry in "overflow", if it had one, is left unused until the
+    // map is rebuilt
+    // return true if it was removed, false if it wasn't there
+    bool    EraseWord(WordMap& wordMap, vector<WordEntry>& overflow, HashValue key, string_view word, StringRef& erased)
+    {
+        WordMap::iterator it = wordMap.find(key);
+        if (it == wordMap.end())
+            return false;
+
+        unsigned int fingerprint = GetFingerprint(word);
+        WordEntry& first = it->second;
+        if (IsWord(first, word, fingerprint))
+        {
+            erased = first._word;
+            if (first._next < 0)
+            {
+                wordMap.erase(it);
+            }
+            else
+            {
+                first = overflow[first._next];
+            }
+            return true;
+        }
+        for (WordEntry* entry = &first; entry->_next >= 0; entry = &overflow[entry->_next])
+        {
+            WordEntry& next = overflow[entry->_next];
+            if (IsWord(next, word, fingerprint))
+            {
+                erased = next._word;
+                entry->_next = next._next;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Return the arena inserted words go in, which is always the map's own. The
+    // dictionary's arena is shared by every map built from it, so the first insert after
+    // CreateMap starts the map's own arena over the top of it
+    StringArena*    GetInsertArena()
+    {
+        if (_arena != &_ownArena)
+        {
+            StringArena arena;
+            arena.SetChunkSize(_ownArena.GetChunkSize());
+            arena.SetParent(_arena);
+            _ownArena.Swap(arena);
+            _arena = &_ownArena;
+            _erasedArenaBytes = 0;
+        }
+        return _arena;
+    }
+
+    // Count the word of an erased entry, "ref", towards compacting the map's own arena.
+    // Only words inserted into it count; the dictionary's words aren't the map's to free
+    void    AddErasedWord(StringRef ref)
+    {
+        if (_arena == &_ownArena && _ownArena.IsAdded(ref))
+        {
+            _erasedArenaBytes += ref._length + 1;
+        }
+    }
+
+    // Return true if the map's own arena should be compacted. It can't free the words
+    // of erased entries, so once they make up half of it the map copies the words it
+    // still holds to a new arena. Inserts alone never compact it, and the copying is
+    // amortised over the erases. A map still using the dictionary's arena has nothing
+    // of its own to compact
+    bool    IsArenaDueCompaction() const
+    {
+        return _arena == &_ownArena && _erasedArenaBytes > _minCompactArenaSize && _erasedArenaBytes * 2 > _ownArena.GetAddedSize();
+    }
+
+    // by default, never compact the map's own arena for less than this in erased words
+    static const size_t MIN_COMPACT_ARENA_SIZE = 4 << 20;
+
+    // where the words are stored. This is the dictionary's arena once CreateMap has
+    // been called, or the map's own if the map is used on its own or has had words
+    // inserted
+    StringArena*                        _arena;
+    StringArena                         _ownArena;
+    size_t                              _erasedArenaBytes;      // bytes of the words erased since _ownArena was compacted
+    size_t                              _minCompactArenaSize;
+
+    Workload                            _workload;
+
+    vector< pair<string, double> >      _buildMs;
+    string                              _buildPhase;
+    chrono::steady_clock::time_point    _buildPhaseStart;
+};
+
+// Runs the benchmark loops of "Map" with the map's own FindHashed, GetHash and
+// Prefetch, called by name rather than through the vtable. The calls can then be
+// inlined into the loops, and the lookups timed don't each include a virtual call.
+// A plain Find is made from GetHash and FindHashed rather than with Map::Find, as the
+// maps' Find calls FindHashed virtually.
+// The maps still derive from HashMapBase, so the lineup can hold them all and run
+// them through one interface; that costs one virtual call to start each pass.
+//   HashMapBase* map = new StaticDispatch< RobinHoodMap<> >();
+template <class Map>
+class StaticDispatch : public Map
+{
+public:
+    template <class... Args>
+    explicit StaticDispatch(Args&&... args)
+        : Map(forward<Args>(args)...)
+    {
+    }
+
+    int     FindBatch(const string* words, int count, bool* found) const
+    {
+        return HashMapBase::FindBatchWith(StaticLookup(this), words, count, found);
+    }
+
+protected:
+    int     RunLookups(const vector<string>& words, LatencyHistogram* latency, LatencyHistogram* hitLatency = NULL) const
+    {
+        return HashMapBase::RunLookupsWith(StaticLookup(this), words, latency, hitLatency);
+    }
+
+private:
+    class StaticLookup
+    {
+    public:
+        explicit StaticLookup(const Map* map)
+            : _map(map)
+        {
+        }
+
+        bool        Find(const string& word) const                  { return _map->Map::FindHashed(_map->Map::GetHash(word), word); }
+        bool        FindHashed(HashValue key, const string& word) const { return _map->Map::FindHashed(key, word); }
+        HashValue   GetHash(const string& word) const               { return _map->Map::GetHash(word); }
+        void        Prefetch(HashValue key, const string& word) const   { _map->Map::Prefetch(key, word); }
+
+    private:
+        const Map*  _map;
+    };
+};
+
+// A class describing a large monolithic map of words
+// This would be the standard implementation in any
+// dictionary-based program.
+template <class Hash = StringHashPolicy>
+class MonolithicMap : public HashMapBase
+{
+public:
+    MonolithicMap()
+        : _wordMap(&_nodes)
+    {
+        _name = string("MonolithicMap<") + Hash::GetName() + ">";
+    }
+
+    virtual ~MonolithicMap()
+    {
+    }
+
+    void    CreateMap(Dictionary* dictionary)
+    {
+        _arena = dictionary->GetArena();
+        int size = dictionary->GetSize();
+
+        // create the hashes for all the strings
+        INSTRUMENT(StartBuildPhase("hash");)
+        vector<HashValue>   hashes(size);
+        for (int loop = 0; loop < size; loop++)
+        {
+            hashes[loop] = Hash::HashEntry(dictionary->GetKVPair(loop), dictionary->GetString(loop));
+        }
+
+        // insert them into the standard associative array if they aren't there already
+        INSTRUMENT(StartBuildPhase("insert");)
+        for (int loop = 0; loop < size; loop++)
+        {
+            AddWord(_wordMap, _overflow, hashes[loop], dictionary->GetKVPair(loop)._value);
+        }
+        INSTRUMENT(StartBuildPhase(NULL);)
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return Hash::Hash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(Hash::Hash(wordToFind), wordToFind);
+    }
+
+    // there's nothing worth prefetching here; the root of the tree is hidden in the map
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        return FindWord(_wordMap, _overflow, key, wordToFind);
+    }
+
+private:
+    string                              _name;
+
+    // store for the standard map of HashKey<->string. Words are never removed, so its
+    // nodes are just bumped off the end of the buffer
+    pmr::monotonic_buffer_resource      _nodes;
+    WordMap                             _wordMap;
+    vector<WordEntry>                   _overflow;
+};
+
+// An ordered index of the same hashes as MonolithicMap, for when the words don't change.
+// What makes the std::map slow isn't the logN compares so much as that each one is a
+// cache miss on a separate heap node. Here the sorted hashes are in one array, in
+// Eytzinger order: the root first, then the two hashes below it, then the four below
+// those, and so on, so the children of position k are at 2k and 2k+1.
+// A search is then a loop with no branches to mispredict. The 8 hashes three levels
+// below the current one share a cache line, which is prefetched three steps before it
+// is needed, so the misses of a lookup overlap rather than follow each other.
+// The words, and any chained after them, are in a second array in the same order, only
+// touched once the hash has been found.
+template <class Hash = StringHashPolicy>
+class EytzingerMap : public HashMapBase
+{
+public:
+    EytzingerMap()
+        : _count(0)
+        , _keys(NULL)
+    {
+        _name = string("EytzingerMap<") + Hash::GetName() + ">";
+    }
+
+    virtual ~EytzingerMap()
+    {
+    }
+
+    // The words are first added to a std::map as MonolithicMap does, which sorts them
+    // and chains those sharing a hash, and then laid out from that
+    void    CreateMap(Dictionary* dictionary)
+    {
+        _arena = dictionary->GetArena();
+        pmr::monotonic_buffer_resource  nodes;
+        WordMap                         wordMap(&nodes);
+        int size = dictionary->GetSize();
+        INSTRUMENT(StartBuildPhase("sort");)
+        for (int loop = 0; loop < size; loop++)
+        {
+            const KVPair& kvPair = dictionary->GetKVPair(loop);
+            AddWord(wordMap, _overflow, Hash::HashEntry(kvPair, dictionary->GetString(loop)), kvPair._value);
+        }
+
+        // position 0 isn't used, so the children of k are at 2k and 2k + 1
+        INSTRUMENT(StartBuildPhase("layout");)
+        _count = wordMap.size();
+        _keyLines.assign(_count / KEYS_PER_LINE + 1, KeyLine());
+        _keys = _keyLines[0]._keys;
+        _entries.assign(_count + 1, WordEntry());
+        WordMap::const_iterator next = wordMap.begin();
+        Fill(1, next);
+        INSTRUMENT(StartBuildPhase(NULL);)
+
+        size_t bytes = _keyLines.size() * sizeof(KeyLine) + _entries.size() * sizeof(WordEntry);
+        size_t mapBytes = _count * (4 * sizeof(void*) + sizeof(pair<HashValue, WordEntry>));
+        cout << "Eytzinger index: " << _count << " hashes in " << bytes << " bytes, about "
+             << mapBytes << " bytes as a std::map" << endl;
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return Hash::Hash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(Hash::Hash(wordToFind), wordToFind);
+    }
+
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        size_t position = LowerBound(key);
+        if (position == 0 || _keys[position] != key)
+            return false;
+
+        unsigned int fingerprint = GetFingerprint(wordToFind);
+        for (const WordEntry* entry = &_entries[position]; ; entry = &_overflow[entry->_next])
+        {
+            if (IsWord(*entry, wordToFind, fingerprint))
+                return true;
+            if (entry->_next < 0)
+                return false;
+            INSTRUMENT(if (entry == &_entries[position]) g_lookupStats.RecordChained();)
+        }
+    }
+
+    // Call "callback" with the hash and each word of every hash from the first that
+    // isn't less than "first", in order of hash, until it returns false
+    template <class Callback>
+    void    Scan(HashValue first, Callback callback) const
+    {
+        for (size_t position = LowerBound(first); position != 0; position = GetNext(position))
+        {
+            for (const WordEntry* entry = &_entries[position]; ; entry = &_overflow[entry->_next])
+            {
+                if (!callback(_keys[position], _arena->Get(entry->_word)))
+                    return;
+                if (entry->_next < 0)
+                    break;
+            }
+        }
+    }
+
+private:
+    static const size_t KEYS_PER_LINE = 64 / sizeof(HashValue);
+
+    struct alignas(64) KeyLine
+    {
+        HashValue   _keys[KEYS_PER_LINE];
+    };
+
+    // Lay out the hashes from "next" onwards in the subtree at "position", in order
+    void    Fill(size_t position, WordMap::const_iterator& next)
+    {
+        if (position <= _count)
+        {
+            Fill(2 * position, next);
+            _keys[position] = next->first;
+            _entries[position] = next->second;
+            ++next;
+            Fill(2 * position + 1, next);
+        }
+    }
+
+    // return the position of the first hash that isn't less than "key", or 0 if there
+    // isn't one. The search goes left at every hash not less than "key", so the answer
+    // is the last place it went left, found by dropping the right turns after it, and
+    // that left turn, from the low bits of where it ended
+    size_t  LowerBound(HashValue key) const
+    {
+        size_t position = 1;
+        while (position <= _count)
+        {
+            PREFETCH(_keys + min(position * KEYS_PER_LINE, _count));
+            position = 2 * position + (_keys[position] < key);
+        }
+        return position >> (GetLowestBit64(~(unsigned long long)position) + 1);
+    }
+
+    // return the position of the hash after the one at "position", or 0 if it's the last
+    size_t  GetNext(size_t position) const
+    {
+        if (2 * position + 1 <= _count)
+        {
+            // the leftmost in the right subtree
+            position = 2 * position + 1;
+            while (2 * position <= _count)
+            {
+                position *= 2;
+            }
+            return position;
+        }
+        // up past every subtree this is the rightmost of
+        return position >> (GetLowestBit64(~(unsigned long long)position) + 1);
+    }
+
+    string              _name;
+    size_t              _count;
+
+    vector<KeyLine>     _keyLines;      // the hashes, aligned to cache lines
+    HashValue*          _keys;          // the hashes in _keyLines, from position 0
+    vector<WordEntry>   _entries;       // the word for each hash, at the same position
+    vector<WordEntry>   _overflow;      // words sharing a hash, chained from _entries
+};
+
+// A class describing large monolithic maps; one for each shard of the words.
+// This will use the top bits of the hash as a lookup, which gives every shard about
+// the same number of words. It should also reduce the likelyhood of collisions
+template <class Hash = StringHashPolicy>
+class ShardedMonolithicMap : public HashMapBase
+{
+public:
+    // "numShards" is rounded up to a power of two
+    ShardedMonolithicMap(int numShards = DEFAULT_NUM_SHARDS)
+        : _shardBits(GetShardBits(numShards))
+        , _nodes((size_t)1 << _shardBits)
+        , _overflow((size_t)1 << _shardBits)
+    {
+        _name = string("ShardedMonolithicMap<") + Hash::GetName() + ">(" + to_string(_nodes.size()) + " shards)";
+        _wordMap.reserve(_nodes.size());
+        for (size_t loop = 0; loop < _nodes.size(); loop++)
+        {
+            _wordMap.emplace_back(&_nodes[loop]);
+        }
+    }
+
+    virtual ~ShardedMonolithicMap()
+    {
+    }
+
+    // The shards are built in parallel
+    void    CreateMap(Dictionary* dictionary)
+    {
+        _arena = dictionary->GetArena();
+        chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+        WorkStealingPool& pool = GetThreadPool();
+        INSTRUMENT(StartBuildPhase("hash and partition");)
+        Partitions  partitions;
+        PartitionByShard<Hash>(dictionary, pool, _shardBits, partitions);
+
+        INSTRUMENT(StartBuildPhase("insert");)
+        vector<int> shards;
+        OrderBySize(partitions, shards);
+        vector< function<void()> > tasks;
+        for (size_t loop = 0; loop < shards.size(); loop++)
+        {
+            int shard = shards[loop];
+            tasks.push_back([this, dictionary, shard, &partitions]()
+            {
+                BuildPartition(dictionary, partitions[shard], shard);
+            });
+        }
+        pool.Run(tasks);
+        INSTRUMENT(StartBuildPhase(NULL);)
+
+        chrono::steady_clock::duration buildTime = chrono::steady_clock::now() - startTime;
+        cout << "Built " << partitions.size() << " shards in " << chrono::duration<double, milli>(buildTime).count()
+             << "ms on " << pool.GetThreadCount() << " threads" << endl;
+        ReportShardOccupancy(partitions);
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return Hash::Hash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(Hash::Hash(wordToFind), wordToFind);
+    }
+
+    void    Prefetch(HashValue key, const string& ) const
+    {
+        PREFETCH(&_wordMap[GetShardIndex(key, _shardBits)]);
+    }
+
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        size_t shard = GetShardIndex(key, _shardBits);
+        return FindWord(_wordMap[shard], _overflow[shard], key, wordToFind);
+    }
+
+private:
+    // Build the map for "shard" from the dictionary words "words"
+    void    BuildPartition(Dictionary* dictionary, const vector<PartitionWord>& words, int shard)
+    {
+        WordMap&    wordMap = _wordMap[shard];
+        wordMap.clear();
+        _nodes[shard].release();
+        _overflow[shard].clear();
+        for (size_t loop = 0; loop < words.size(); loop++)
+        {
+            const KVPair& kvPair = dictionary->GetKVPair(words[loop]._index);
+
+            // insert it into the standard associative array if it isn't there already
+            AddWord(wordMap, _overflow[shard], words[loop]._hash, kvPair._value);
+        }
+    }
+
+    string                              _name;
+    int                                 _shardBits;
+
+    // store for the standard map of HashKey<->string. The shards are built on
+    // different threads, so each has its own buffer for its nodes
+    vector<pmr::monotonic_buffer_resource>  _nodes;
+    vector<WordMap>                     _wordMap;
+    vector< vector<WordEntry> >         _overflow;
+};
+
+// The hashMap structure for each shard of the words. The _arraySize is picked from
+// the number of words in the shard, which is about the same for every shard
+// While a HashArray grows, the buckets of the new table are made a few at a time, and
+// then the buckets of the table it is growing out of are moved to the new one a few at
+// a time. A word is in the old table if its bucket there hasn't been moved yet, and in
+// the new table otherwise, so nothing is looked for in the new table until it is whole.
+// The nodes of every bucket in both tables come from the HashArray's own pool, so
+// moving a node between tables keeps it where it is, and an erased word's node is
+// reused by the next insert.
+struct HashArray
+{
+    HashArray()
+        : _nodes(GetPoolOptions())
+        , _arraySize(1)
+        , _count(0)
+        , _oldArraySize(0)
+        , _migrated(0)
+    {
+        _hashMap.emplace_back(&_nodes);
+    }
+
+    // The pool's blocks grow up to NODES_PER_BLOCK nodes, so not much more than that
+    // is left unused
+    static pmr::pool_options    GetPoolOptions()
+    {
+        pmr::pool_options   options;
+        options.max_blocks_per_chunk = NODES_PER_BLOCK;
+        return options;
+    }
+
+    static const size_t                 NODES_PER_BLOCK = 1024;
+
+    pmr::unsynchronized_pool_resource   _nodes;         // the map nodes of both tables
+    int                                 _arraySize;
+    vector<WordMap>                     _hashMap;
+    int                                 _count;         // words in _hashMap and _oldHashMap
+    int                                 _oldArraySize;  // buckets in _oldHashMap, 0 unless growing
+    vector<WordMap>                     _oldHashMap;    // the table being grown out of
+    int                                 _migrated;      // buckets of _oldHashMap already moved
+    vector<WordEntry>                   _overflow;      // words sharing a hash, for every bucket of both tables
+};
+
+template <class Hash = StringHashPolicy, class Sizing = PrimeSizingPolicy>
+class HashMap : public HashMapBase
+{
+public:
+    // "wordsPerBucket" is the average number of words per bucket the tables are sized
+    // for. A table grows when it reaches twice that. "numShards" is rounded up to a
+    // power of two
+    HashMap(int wordsPerBucket = 8, int numShards = DEFAULT_NUM_SHARDS)
+        : _wordsPerBucket(max(wordsPerBucket, 1))
+        , _shardBits(GetShardBits(numShards))
+        , _shards((size_t)1 << _shardBits)
+    {
+        _name = string("HashMap<") + Hash::GetName() + ">(" + Sizing::GetName() + ", " + to_string(_wordsPerBucket) + " words/bucket, "
+              + to_string(_shards.size()) + " shards)";
+    }
+
+    ~HashMap()
+    {
+    }
+
+    // The shards are built in parallel
+    void    CreateMap(Dictionary* dictionary)
+    {
+        _arena = dictionary->GetArena();
+        chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+        WorkStealingPool& pool = GetThreadPool();
+        INSTRUMENT(StartBuildPhase("hash and partition");)
+        Partitions  partitions;
+        PartitionByShard<Hash>(dictionary, pool, _shardBits, partitions);
+
+        INSTRUMENT(StartBuildPhase("insert");)
+        vector<int> shards;
+        OrderBySize(partitions, shards);
+        vector< function<void()> > tasks;
+        for (size_t loop = 0; loop < shards.size(); loop++)
+        {
+            int shard = shards[loop];
+            tasks.push_back([this, dictionary, shard, &partitions]()
+            {
+                BuildPartition(dictionary, partitions[shard], shard);
+            });
+        }
+        pool.Run(tasks);
+        INSTRUMENT(StartBuildPhase(NULL);)
+
+        chrono::steady_clock::duration buildTime = chrono::steady_clock::now() - startTime;
+        cout << "Built " << partitions.size() << " shards in " << chrono::duration<double, milli>(buildTime).count()
+             << "ms on " << pool.GetThreadCount() << " threads" << endl;
+        ReportShardOccupancy(partitions);
+
+        // sum up the buckets of all the shards
+        int numBuckets = 0;
+        int numEmptyBuckets = 0;
+        int minBucketSize = -1;         // none seen yet
+        int maxBucketSize = 0;
+        size_t numEntries = 0;
+        for (size_t shardLoop = 0; shardLoop < _shards.size(); shardLoop++)
+        {
+            HashArray&  hashMap = _shards[shardLoop];
+            numBuckets += hashMap._arraySize;
+            for (int loop = 0; loop < hashMap._arraySize; loop++)
+            {
+                int size = hashMap._hashMap[loop].size();
+                if (size == 0)
+                {
+                    numEmptyBuckets++;
+                }
+                if (minBucketSize < 0 || size < minBucketSize)
+                {
+                    minBucketSize = size;
+                }
+                maxBucketSize = max(maxBucketSize, size);
+                numEntries += size;
+            }
+        }
+        cout << numBuckets << " buckets, " << numEmptyBuckets << " empty, " << max(minBucketSize, 0) << " to "
+             << maxBucketSize << " entries per bucket, mean " << (numBuckets > 0 ? (double)numEntries / numBuckets : 0.0) << endl;
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return Hash::Hash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(Hash::Hash(wordToFind), wordToFind);
+    }
+
+    // the bucket's map is the first miss of a lookup
+    void    Prefetch(HashValue key, const string& ) const
+    {
+        PREFETCH(&GetBucket(_shards[GetShardIndex(key, _shardBits)], key));
+    }
+
+    // the probes are the hashes in the bucket's map
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        const HashArray&  hashMap = _shards[GetShardIndex(key, _shardBits)];
+        INSTRUMENT(g_lookupStats.RecordProbes(GetBucket(hashMap, key).size());)
+        return FindWord(GetBucket(hashMap, key), hashMap._overflow, key, wordToFind);
+    }
+
+    // Insert "word" into the map. When a shard's table gets too full a bigger one is
+    // started, and every Insert and Erase moves a few more buckets across, so no single
+    // call pays for rebuilding the whole table.
+    // Inserted words go in the map's own arena, over the top of the dictionary's, so
+    // other maps built from the dictionary aren't written to. Erase compacts it.
+    // return true if it was added, false if it was already there or is empty
+    bool    Insert(const string& word)
+    {
+        if (word.empty())
+            return false;
+
+        HashValue hash = Hash::Hash(word);
+        HashArray&  hashMap = _shards[GetShardIndex(hash, _shardBits)];
+        MigrateBuckets(hashMap, MIGRATE_BUCKETS_PER_OPERATION);
+
+        WordMap&    bucket = GetBucket(hashMap, hash);
+        if (FindWord(bucket, hashMap._overflow, hash, word))
+            return false;
+
+        StringRef ref = GetInsertArena()->Add(word);
+        AddWord(bucket, hashMap._overflow, hash, ref);
+        hashMap._count++;
+        if (hashMap._oldArraySize == 0 && hashMap._count > hashMap._arraySize * _wordsPerBucket * 2)
+        {
+            StartGrowing(hashMap);
+        }
+        return true;
+    }
+
+    // Remove "word" from the map
+    // return true if it was removed, false if it wasn't there
+    bool    Erase(const string& word)
+    {
+        if (word.empty())
+            return false;
+
+        HashValue hash = Hash::Hash(word);
+        HashArray&  hashMap = _shards[GetShardIndex(hash, _shardBits)];
+        MigrateBuckets(hashMap, MIGRATE_BUCKETS_PER_OPERATION);
+
+        StringRef erased;
+        if (!EraseWord(GetBucket(hashMap, hash), hashMap._overflow, hash, word, erased))
+            return false;
+
+        hashMap._count--;
+        AddErasedWord(erased);
+        if (IsArenaDueCompaction())
+        {
+            CompactArena();
+        }
+        return true;
+    }
+
+    // Move up to "numBuckets" buckets of each growing table into its new table, so a
+    // background tick can finish growing tables that aren't being written to
+    void    Migrate(int numBuckets)
+    {
+        for (size_t loop = 0; loop < _shards.size(); loop++)
+        {
+            MigrateBuckets(_shards[loop], numBuckets);
+        }
+    }
+
+    // return true if any shard's table is part way through growing
+    bool    IsGrowing() const
+    {
+        for (size_t loop = 0; loop < _shards.size(); loop++)
+        {
+            if (_shards[loop]._oldArraySize > 0)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    static const int    MIGRATE_BUCKETS_PER_OPERATION = 4;
+    static const int    BUCKETS_MADE_PER_MIGRATED = 16;     // new buckets made in the time of moving one
+
+    // Copy the words inserted into the map that are still in it to a new arena over the
+    // same parent, and use that instead. Each shard's overflow list is rebuilt at the same
+    // time with just the entries still chained, dropping those of erased words
+    void    CompactArena()
+    {
+        StringArena arena;
+        arena.SetChunkSize(_ownArena.GetChunkSize());
+        arena.SetParent(_ownArena.GetParent());
+        for (size_t shard = 0; shard < _shards.size(); shard++)
+        {
+            HashArray&  hashMap = _shards[shard];
+            vector<WordEntry>   overflow;
+            CompactBuckets(hashMap._hashMap, hashMap._overflow, arena, overflow);
+            CompactBuckets(hashMap._oldHashMap, hashMap._overflow, arena, overflow);
+            hashMap._overflow.swap(overflow);
+        }
+        _ownArena.Swap(arena);
+        _erasedArenaBytes = 0;
+    }
+
+    // Move the words of "buckets" that were added to the map's own arena into "arena",
+    // and copy the overflow entries chained from them, in "oldOverflow", to "overflow"
+    void    CompactBuckets(vector<WordMap>& buckets, const vector<WordEntry>& oldOverflow, StringArena& arena, vector<WordEntry>& overflow) const
+    {
+        for (size_t bucket = 0; bucket < buckets.size(); bucket++)
+        {
+            for (WordMap::iterator it = buckets[bucket].begin(); it != buckets[bucket].end(); ++it)
+            {
+                WordEntry& first = it->second;
+                MoveWord(first, arena);
+                int next = first._next;
+                if (next >= 0)
+                {
+                    first._next = (int)overflow.size();
+                }
+                while (next >= 0)
+                {
+                    WordEntry entry = oldOverflow[next];
+                    MoveWord(entry, arena);
+                    next = entry._next;
+                    entry._next = next >= 0 ? (int)overflow.size() + 1 : -1;
+                    overflow.push_back(entry);
+                }
+            }
+        }
+    }
+
+    // copy the word of "entry" to "arena" if it was added to the map's own arena
+    void    MoveWord(WordEntry& entry, StringArena& arena) const
+    {
+        if (_ownArena.IsAdded(entry._word))
+        {
+            entry._word = arena.Add(_ownArena.Get(entry._word));
+        }
+    }
+
+    // Build the table for "shard" from the dictionary words "words"
+    void    BuildPartition(Dictionary* dictionary, const vector<PartitionWord>& words, int shard)
+    {
+        HashArray&  hashMap = _shards[shard];
+        hashMap._oldHashMap.clear();
+        hashMap._oldArraySize = 0;
+        hashMap._migrated = 0;
+        hashMap._count = 0;
+        hashMap._overflow.clear();
+
+        // every node is gone, so the pool can hand its memory back in one go
+        hashMap._hashMap.clear();
+        hashMap._nodes.release();
+
+        int arraySize = Sizing::GetBucketCount((int)words.size() / _wordsPerBucket);
+        hashMap._arraySize = arraySize;
+        hashMap._hashMap = CreateBuckets(hashMap, arraySize);
+
+        for (size_t loop = 0; loop < words.size(); loop++)
+        {
+            const KVPair& kvPair = dictionary->GetKVPair(words[loop]._index);
+            HashValue hash = words[loop]._hash;
+
+            // take modulo and insert it into the hash map if it isn't there already
+            WordMap&    bucket = hashMap._hashMap[Sizing::GetBucketIndex(hash, arraySize)];
+            if (AddWord(bucket, hashMap._overflow, hash, kvPair._value))
+            {
+                hashMap._count++;
+            }
+        }
+    }
+
+    // the bucket "key" is in
+    static const WordMap&   GetBucket(const HashArray& hashMap, HashValue key)
+    {
+        if (hashMap._oldArraySize > 0)
+        {
+            int oldIndex = Sizing::GetBucketIndex(key, hashMap._oldArraySize);
+            if (oldIndex >= hashMap._migrated)
+                return hashMap._oldHashMap[oldIndex];
+        }
+        return hashMap._hashMap[Sizing::GetBucketIndex(key, hashMap._arraySize)];
+    }
+
+    static WordMap& GetBucket(HashArray& hashMap, HashValue key)
+    {
+        return const_cast<WordMap&>(GetBucket(const_cast<const HashArray&>(hashMap), key));
+    }
+
+    // a table of "arraySize" empty buckets, whose nodes come from the pool of "hashMap"
+    static vector<WordMap>  CreateBuckets(HashArray& hashMap, int arraySize)
+    {
+        vector<WordMap> buckets;
+        buckets.reserve(arraySize);
+        for (int loop = 0; loop < arraySize; loop++)
+        {
+            buckets.emplace_back(&hashMap._nodes);
+        }
+        return buckets;
+    }
+
+    // Start moving "hashMap" to a table twice the size. The new table's buckets are
+    // made by MigrateBuckets, so nothing is made or moved yet
+    void    StartGrowing(HashArray& hashMap) const
+    {
+        int arraySize = Sizing::GetBucketCount(hashMap._count / _wordsPerBucket);
+        if (arraySize <= hashMap._arraySize)
+            return;
+
+        hashMap._oldHashMap.swap(hashMap._hashMap);
+        hashMap._oldArraySize = hashMap._arraySize;
+        hashMap._migrated = 0;
+        hashMap._hashMap = vector<WordMap>();
+        hashMap._hashMap.reserve(arraySize);
+        hashMap._arraySize = arraySize;
+    }
+
+    // Move the next "numBuckets" buckets of the old table into the new one. The map nodes
+    // themselves are moved, so nothing is allocated or copied. Until every bucket of the
+    // new table has been made, BUCKETS_MADE_PER_MIGRATED of them are made for each one
+    // that would have been moved instead
+    static void MigrateBuckets(HashArray& hashMap, int numBuckets)
+    {
+        if (hashMap._oldArraySize == 0)
+            return;
+
+        if ((int)hashMap._hashMap.size() < hashMap._arraySize)
+        {
+            int last = min((int)hashMap._hashMap.size() + numBuckets * BUCKETS_MADE_PER_MIGRATED, hashMap._arraySize);
+            while ((int)hashMap._hashMap.size() < last)
+            {
+                hashMap._hashMap.emplace_back(&hashMap._nodes);
+            }
+            return;
+        }
+
+        int last = min(hashMap._migrated + numBuckets, hashMap._oldArraySize);
+        for (; hashMap._migrated < last; hashMap._migrated++)
+        {
+            WordMap&    oldBucket = hashMap._oldHashMap[hashMap._migrated];
+            while (!oldBucket.empty())
+            {
+                HashValue hash = oldBucket.begin()->first;
+                hashMap._hashMap[Sizing::GetBucketIndex(hash, hashMap._arraySize)].insert(oldBucket.extract(oldBucket.begin()));
+            }
+        }
+
+        if (hashMap._migrated == hashMap._oldArraySize)
+        {
+            vector<WordMap>().swap(hashMap._oldHashMap);
+            hashMap._oldArraySize = 0;
+            hashMap._migrated = 0;
+        }
+    }
+
+    string              _name;
+    int                 _wordsPerBucket;
+    int                 _shardBits;
+    vector<HashArray>   _shards;
+};
+
+// A flat open-addressing hash table using Robin Hood probing.
+// All entries live in one power-of-two sized table instead of an array of maps, so a
+// lookup is a single probe sequence through contiguous memory rather than a tree walk.
+// On insert, an entry that is further from its home slot than the one occupying a slot
+// takes that slot ("robs the rich"), which keeps probe lengths short and uniform.
+// Deletes shift the following entries back by one instead of leaving tombstones, so
+// lookups never have to skip over dead slots.
+// The table is generic over the "Entry" kept in each slot. Each entry comes with a
+// 32-bit hash and is found by its hash and a function that checks a match, so the
+// table doesn't need to know what is in an entry or how to compare one. RobinHoodMap
+// keeps words in it, and RobinHoodKeyValueMap a key and a value.
+
+// A slot holds the hash and probe distance together with the entry, so a hit on an
+// entry that holds its whole key, such as an inline word, reads a single slot. Slots
+// are aligned to the power of two at or above their size, up to a cache line, so a
+// slot never straddles two lines.
+template <class Entry>
+struct alignas(8 + sizeof(Entry) <= 16 ? 16 : 8 + sizeof(Entry) <= 32 ? 32 : 64) RobinHoodSlot
+{
+    unsigned int    _hash;
+    unsigned int    _distance;      // distance from the home slot + 1. 0 means empty
+    Entry           _entry;
+};
+
+// The range of load factors a RobinHoodTable can be given. At or below 0 it would never
+// find a big enough capacity, and once full a miss would never end its probe
+static const float  ROBIN_HOOD_MIN_LOAD_FACTOR = 0.1f;
+static const float  ROBIN_HOOD_MAX_LOAD_FACTOR = 0.95f;
+
+template <class Entry>
+class RobinHoodTable
+{
+public:
+    // "maxLoadFactor" is clamped to the ROBIN_HOOD_*_LOAD_FACTOR range
+    RobinHoodTable(float maxLoadFactor = 0.9f)
+        : _maxLoadFactor(min(max(maxLoadFactor, ROBIN_HOOD_MIN_LOAD_FACTOR), ROBIN_HOOD_MAX_LOAD_FACTOR))
+        , _count(0)
+        , _mask(0)
+        , _shift(32)
+    {
+    }
+
+    // the table works with 32-bit hashes
+    static unsigned int FoldHash(unsigned long long hash)
+    {
+        return (unsigned int)(hash ^ (hash >> 32));
+    }
+
+    // Make room for "count" entries, so inserting them won't grow the table
+    void    Reserve(int count)
+    {
+        size_t capacity = GetCapacityFor(count);
+        if (capacity > _slots.size())
+        {
+            Rehash(capacity);
+        }
+    }
+
+    int     GetCount() const
+    {
+        return _count;
+    }
+
+    // start loading the home slot of "hash"
+    void    Prefetch(unsigned int hash) const
+    {
+        if (_count > 0)
+        {
+            PREFETCH(&_slots[GetHomeSlot(hash)]);
+        }
+    }
+
+    // return the slot of the entry with "hash" that "isEntry" returns true for, or -1
+    // if there isn't one
+    template <class IsEntry>
+    int     FindSlot(unsigned int hash, IsEntry isEntry) const
+    {
+        if (_count == 0)
+            return -1;
+
+        unsigned int slot = GetHomeSlot(hash);
+        for (unsigned int distance = 1; ; distance++)
+        {
+            const Slot& entry = _slots[slot];
+
+            // an empty slot, or one nearer its home than we are to ours, means the
+            // entry can't be further along
+            if (entry._distance < distance)
+            {
+                INSTRUMENT(g_lookupStats.RecordProbes(distance);)
+                return -1;
+            }
+            if (entry._hash == hash && isEntry(entry._entry))
+            {
+                INSTRUMENT(g_lookupStats.RecordProbes(distance);)
+                return slot;
+            }
+            slot = (slot + 1) & _mask;
+        }
+    }
+
+    // the entry in "slot", from FindSlot
+    const Entry&    GetEntry(int slot) const
+    {
+        return _slots[slot]._entry;
+    }
+
+    // insert an entry known not to be in the table
+    void    InsertNew(unsigned int hash, Entry entry)
+    {
+        if (_count + 1 > _slots.size() * _maxLoadFactor)
+        {
+            Rehash(GetCapacityFor(_count + 1));
+        }
+
+        while (!Place(hash, entry))
+        {
+            Rehash(_slots.size() * 2);
+        }
+        _count++;
+    }
+
+    // remove the entry in "slot", from FindSlot
+    void    EraseSlot(int slot)
+    {
+        // backward shift: pull every following entry that isn't in its home slot back
+        // by one, until an empty slot or an entry already at home is reached
+        int next = (slot + 1) & _mask;
+        while (_slots[next]._distance > 1)
+        {
+            _slots[slot] = _slots[next];
+            _slots[slot]._distance--;
+            slot = next;
+            next = (next + 1) & _mask;
+        }
+        _slots[slot]._distance = 0;
+        _count--;
+    }
+
+    // Call "function" with every entry in the table. It may change an entry, as long as
+    // the entry still has the same hash and matches the same lookups
+    template <class Function>
+    void    ForEachEntry(Function function)
+    {
+        for (size_t slot = 0; slot < _slots.size(); slot++)
+        {
+            if (_slots[slot]._distance != 0)
+            {
+                function(_slots[slot]._entry);
+            }
+        }
+    }
+
+private:
+    typedef RobinHoodSlot<Entry>    Slot;
+
+    static const unsigned int MAX_DISTANCE = 255;   // grow rather than let probes get longer than this
+
+    size_t  GetCapacityFor(int count) const
+    {
+        size_t capacity = 16;
+        while (capacity * _maxLoadFactor < count)
+        {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    // Fibonacci hashing. Multiplying by 2^32/phi and taking the top bits spreads the
+    // hash over the whole table even if the low bits of the hash are poor
+    unsigned int    GetHomeSlot(unsigned int hash) const
+    {
+        return (hash * 2654435769u) >> _shift;
+    }
+
+    // Robin Hood insertion of an entry known not to be in the table.
+    // return false if a probe got too long, in which case "hash" and "entry" hold
+    // whichever entry was displaced last and the table must grow before retrying
+    bool    Place(unsigned int& hash, Entry& entry)
+    {
+        unsigned int slot = GetHomeSlot(hash);
+        for (unsigned int distance = 1; distance < MAX_DISTANCE; distance++)
+        {
+            Slot& current = _slots[slot];
+            if (current._distance == 0)
+            {
+                current._hash = hash;
+                current._distance = distance;
+                current._entry = entry;
+                return true;
+            }
+            if (current._distance < distance)
+            {
+                // this entry is closer to home than we are. Take its place and carry on
+                // inserting the displaced entry instead
+                swap(current._hash, hash);
+                swap(current._distance, distance);
+                swap(current._entry, entry);
+            }
+            slot = (slot + 1) & _mask;
+        }
+        return false;
+    }
+
+    void    Rehash(size_t capacity)
+    {
+        vector<Slot>    oldSlots;
+        oldSlots.swap(_slots);
+
+        for (;;)
+        {
+            _slots.assign(capacity, Slot());
+            _mask = capacity - 1;
+            _shift = 32;
+            for (size_t bits = capacity; bits > 1; bits >>= 1)
+            {
+                _shift--;
+            }
+
+            size_t loop = 0;
+            for (; loop < oldSlots.size(); loop++)
+            {
+                if (oldSlots[loop]._distance != 0)
+                {
+                    if (!Place(oldSlots[loop]._hash, oldSlots[loop]._entry))
+                        break;
+                    oldSlots[loop]._distance = 0;
+                }
+            }
+            if (loop == oldSlots.size())
+                return;
+
+            // can only happen with a pathological hash. The entry left over is back in
+            // oldSlots[loop], so put everything placed so far back in the free old slots
+            // and start again, bigger
+            size_t freeSlot = 0;
+            for (size_t slot = 0; slot < _slots.size(); slot++)
+            {
+                if (_slots[slot]._distance != 0)
+                {
+                    while (oldSlots[freeSlot]._distance != 0)
+                    {
+                        freeSlot++;
+                    }
+                    oldSlots[freeSlot] = _slots[slot];
+                    oldSlots[freeSlot]._distance = 1;
+                }
+            }
+            capacity *= 2;
+        }
+    }
+
+    float           _maxLoadFactor;
+    int             _count;
+    unsigned int    _mask;
+    int             _shift;
+    vector<Slot>    _slots;
+};
+
+// The dictionary in a RobinHoodTable. Each entry is the Storage policy's Value for a
+// word, and the full word is stored, so a hash match is verified with a string compare
+// and no collision table is needed.
+// Inserted words go in the map's own arena, which is compacted as erased words build
+// up in it.
+template <class Hash = StringHashPolicy, class Storage = ArenaWordStorage>
+class RobinHoodMap : public HashMapBase
+{
+public:
+    RobinHoodMap(float maxLoadFactor = 0.9f)
+        : _table(maxLoadFactor)
+    {
+        _name = string("RobinHoodMap<") + Hash::GetName() + ">(" + Storage::GetName() + ")";
+    }
+
+    virtual ~RobinHoodMap()
+    {
+    }
+
+    void    CreateMap(Dictionary* dictionary)
+    {
+        _arena = dictionary->GetArena();
+        int size = dictionary->GetSize();
+        _table.Reserve(size);
+
+        INSTRUMENT(StartBuildPhase("hash");)
+        vector<unsigned int>    hashes(size);
+        for (int loop = 0; loop < size; loop++)
+        {
+            hashes[loop] = Table::FoldHash(Hash::HashEntry(dictionary->GetKVPair(loop), dictionary->GetString(loop)));
+        }
+
+        INSTRUMENT(StartBuildPhase("insert");)
+        for (int loop = 0; loop < size; loop++)
+        {
+            if (FindSlot(hashes[loop], dictionary->GetString(loop)) < 0)
+            {
+                _table.InsertNew(hashes[loop], Storage::Store(_arena, dictionary->GetKVPair(loop)._value));
+            }
+        }
+        INSTRUMENT(StartBuildPhase(NULL);)
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    bool    RefersToDictionaryArena() const
+    {
+        return Storage::REFERS_TO_ARENA;
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return Hash::Hash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(Hash::Hash(wordToFind), wordToFind);
+    }
+
+    // the home slot, and the word in the arena if it isn't inline, are all a hit
+    // normally touches
+    void    Prefetch(HashValue key, const string& ) const
+    {
+        _table.Prefetch(Table::FoldHash(key));
+    }
+
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        return FindSlot(Table::FoldHash(key), wordToFind) >= 0;
+    }
+
+    // Insert "word" into the table
+    // return true if it was added, false if it was already there
+    bool    Insert(string_view word)
+    {
+        return InsertHashed(Hash::Hash(word), word);
+    }
+
+    // Insert, with the hash of the word already calculated
+    bool    InsertHashed(HashValue key, string_view word)
+    {
+        unsigned int hash = Table::FoldHash(key);
+        if (FindSlot(hash, word) >= 0)
+            return false;
+
+        StringRef ref = GetInsertArena()->Add(word);
+        _table.InsertNew(hash, Storage::Store(_arena, ref));
+        return true;
+    }
+
+    // Remove "word" from the table
+    // return true if it was removed, false if it wasn't there
+    bool    Erase(string_view word)
+    {
+        int slot = FindSlot(Table::FoldHash(Hash::Hash(word)), word);
+        if (slot < 0)
+            return false;
+
+        StringRef erased;
+        if (Storage::GetRef(_table.GetEntry(slot), erased))
+        {
+            AddErasedWord(erased);
+        }
+        _table.EraseSlot(slot);
+        if (IsArenaDueCompaction())
+        {
+            CompactArena();
+        }
+        return true;
+    }
+
+    int     GetCount() const
+    {
+        return _table.GetCount();
+    }
+
+    // return the bytes held by the map's own arena for inserted words
+    size_t  GetArenaSize() const
+    {
+        return _ownArena.GetAddedSize();
+    }
+
+private:
+    typedef typename Storage::Value Value;
+    typedef RobinHoodTable<Value>   Table;
+
+    int     FindSlot(unsigned int hash, string_view word) const
+    {
+        const StringArena* arena = _arena;
+        return _table.FindSlot(hash, [arena, word](const Value& value)
+        {
+            return Storage::IsWord(arena, value, word);
+        });
+    }
+
+    // Copy the words inserted into the map that are still in it to a new arena over the
+    // same parent, dropping those of erased entries, and use that instead
+    void    CompactArena()
+    {
+        StringArena arena;
+        arena.SetChunkSize(_ownArena.GetChunkSize());
+        arena.SetParent(_ownArena.GetParent());
+        _table.ForEachEntry([this, &arena](Value& value)
+        {
+            value = Storage::Move(&_ownArena, &arena, value);
+        });
+        _ownArena.Swap(arena);
+        _erasedArenaBytes = 0;
+    }
+
+    string          _name;
+    Table           _table;
+};
+
+// A hash map from any "Key" to any "Value" in a RobinHoodTable, for when what's stored
+// isn't a word. "KeyHash" hashes a Key as std::hash does, and keys are compared with
+// ==. The key and value are kept in the slot, so lookups are fastest when they're small.
+template <class Key, class Value, class KeyHash = hash<Key> >
+class RobinHoodKeyValueMap
+{
+public:
+    RobinHoodKeyValueMap(float maxLoadFactor = 0.9f)
+        : _table(maxLoadFactor)
+    {
+    }
+
+    // Make room for "count" entries, so inserting them won't grow the map
+    void    Reserve(int count)
+    {
+        _table.Reserve(count);
+    }
+
+    // return the value stored for "key", or NULL if it isn't in the map
+    const Value*    Find(const Key& key) const
+    {
+        int slot = FindSlot(GetHash(key), key);
+        return slot >= 0 ? &_table.GetEntry(slot).second : NULL;
+    }
+
+    // Insert "key" with "value"
+    // return true if it was added, false if "key" was already there, in which case its
+    // value is left as it was
+    bool    Insert(const Key& key, const Value& value)
+    {
+        unsigned int hash = GetHash(key);
+        if (FindSlot(hash, key) >= 0)
+            return false;
+
+        _table.InsertNew(hash, Entry(key, value));
+        return true;
+    }
+
+    // Remove "key" and its value
+    // return true if it was removed, false if it wasn't there
+    bool    Erase(const Key& key)
+    {
+        int slot = FindSlot(GetHash(key), key);
+        if (slot < 0)
+            return false;
+
+        _table.EraseSlot(slot);
+        return true;
+    }
+
+    int     GetCount() const
+    {
+        return _table.GetCount();
+    }
+
+private:
+    typedef pair<Key, Value>        Entry;
+    typedef RobinHoodTable<Entry>   Table;
+
+    static unsigned int GetHash(const Key& key)
+    {
+        return Table::FoldHash(KeyHash()(key));
+    }
+
+    int     FindSlot(unsigned int hash, const Key& key) const
+    {
+        return _table.FindSlot(hash, [&key](const Entry& entry)
+        {
+            return entry.first == key;
+        });
+    }
+
+    Table           _table;
+};
+
+// SwissTable-style open-addressing hash map.
+// Slots are arranged in groups of 16. Alongside the slots is an array of control bytes,
+// one per slot, holding either EMPTY or a 7-bit fingerprint of the hash of the word in
+// that slot. A lookup compares its own fingerprint against a whole group of control
+// bytes in one SIMD instruction, and only looks at the words in slots whose fingerprint
+// matched, which is almost always just the one being searched for. A group containing
+// an empty slot ends the search.
+// With AVX2, two groups are compared at a time. The control bytes of the first group are
+// repeated after the last so a group can always be read alongside the next without
+// wrapping.
+static const int            SWISS_GROUP_SIZE = 16;
+static const unsigned char  SWISS_EMPTY = 0x80;
+
+// Each function compares the control bytes at "control" against "tag", returning a bit
+// mask of the matching bytes, and sets "emptyMask" to a mask of the empty ones
+typedef unsigned int (*SwissMatchFunction)(const unsigned char* control, unsigned char tag, unsigned int& emptyMask);
+
+static unsigned int SwissMatchScalar(const unsigned char* control, unsigned char tag, unsigned int& emptyMask)
+{
+    unsigned int tagMask = 0;
+    emptyMask = 0;
+    for (int loop = 0; loop < SWISS_GROUP_SIZE; loop++)
+    {
+        if (control[loop] == tag)
+        {
+            tagMask |= 1 << loop;
+        }
+        if (control[loop] == SWISS_EMPTY)
+        {
+            emptyMask |= 1 << loop;
+        }
+    }
+    return tagMask;
+}
+
+#if defined(HAVE_X86_SIMD)
+static unsigned int SwissMatchSse2(const unsigned char* control, unsigned char tag, unsigned int& emptyMask)
+{
+    __m128i group = _mm_loadu_si128((const __m128i*)control);
+    emptyMask = _mm_movemask_epi8(group);     // only EMPTY has the top bit set
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+}
+
+TARGET_AVX2 static unsigned int SwissMatchAvx2(const unsigned char* control, unsigned char tag, unsigned int& emptyMask)
+{
+    __m256i groups = _mm256_loadu_si256((const __m256i*)control);
+    emptyMask = _mm256_movemask_epi8(groups);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(groups, _mm256_set1_epi8((char)tag)));
+}
+#endif
+
+template <class Hash = StringHashPolicy, class Storage = ArenaWordStorage>
+class SwissMap : public HashMapBase
+{
+public:
+    // "simdLevel" caps the instructions used, so the scalar and SSE2 versions can be
+    // compared on a machine with AVX2
+    SwissMap(SimdLevel simdLevel = SIMD_AVX2)
+        : _count(0)
+        , _groupMask(0)
+    {
+        _simdLevel = min(simdLevel, GetSimdLevel());
+        switch (_simdLevel)
+        {
+#if defined(HAVE_X86_SIMD)
+        case SIMD_AVX2:
+            _match = SwissMatchAvx2;
+            _groupsPerMatch = 2;
+            break;
+        case SIMD_SSE2:
+            _match = SwissMatchSse2;
+            _groupsPerMatch = 1;
+            break;
+#endif
+        default:
+            _match = SwissMatchScalar;
+            _groupsPerMatch = 1;
+            break;
+        }
+        _name = string("SwissMap<") + Hash::GetName() + ">(" + GetSimdLevelName(_simdLevel) + ", " + Storage::GetName() + ")";
+    }
+
+    virtual ~SwissMap()
+    {
+    }
+
+    void    CreateMap(Dictionary* dictionary)
+    {
+        int size = dictionary->GetSize();
+
+        // keep the table at most 7/8 full so every probe sequence ends at an empty slot
+        size_t numGroups = 1;
+        while (numGroups * SWISS_GROUP_SIZE * 7 / 8 < (size_t)size)
+        {
+            numGroups *= 2;
+        }
+        size_t capacity = numGroups * SWISS_GROUP_SIZE;
+        _control.assign(capacity + SWISS_GROUP_SIZE, SWISS_EMPTY);
+        _values.assign(capacity, Value());
+        _groupMask = numGroups - 1;
+        _count = 0;
+        _arena = dictionary->GetArena();
+
+        INSTRUMENT(StartBuildPhase("hash");)
+        vector<HashValue>   hashes(size);
+        for (int loop = 0; loop < size; loop++)
+        {
+            hashes[loop] = Hash::HashEntry(dictionary->GetKVPair(loop), dictionary->GetString(loop));
+        }
+
+        INSTRUMENT(StartBuildPhase("insert");)
+        for (int loop = 0; loop < size; loop++)
+        {
+            if (FindSlot(hashes[loop], dictionary->GetString(loop)) < 0)
+            {
+                Insert(hashes[loop], dictionary->GetKVPair(loop)._value);
+            }
+        }
+        INSTRUMENT(StartBuildPhase(NULL);)
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    bool    RefersToDictionaryArena() const
+    {
+        return Storage::REFERS_TO_ARENA;
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return Hash::Hash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(Hash::Hash(wordToFind), wordToFind);
+    }
+
+    void    Prefetch(HashValue key, const string& ) const
+    {
+        if (_count > 0)
+        {
+            PREFETCH(&_control[GetFirstGroup(MixHash(key)) * SWISS_GROUP_SIZE]);
+        }
+    }
+
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        return FindSlot(key, wordToFind) >= 0;
+    }
+
+private:
+    typedef typename Storage::Value Value;
+
+    // The top 7 bits of the mixed hash are the fingerprint and the bits below pick
+    // the first group, so the two are independent
+    static unsigned long long MixHash(HashValue hash)
+    {
+        return hash * 0x9E3779B97F4A7C15ull;
+    }
+
+    static unsigned char GetTag(unsigned long long mixedHash)
+    {
+        return (unsigned char)(mixedHash >> 57);
+    }
+
+    size_t  GetFirstGroup(unsigned long long mixedHash) const
+    {
+        return (size_t)(mixedHash >> 16) & _groupMask;
+    }
+
+    int     FindSlot(HashValue hash, string_view word) const
+    {
+        if (_count == 0)
+            return -1;
+
+        unsigned long long mixedHash = MixHash(hash);
+        unsigned char tag = GetTag(mixedHash);
+        size_t slotMask = _values.size() - 1;
+        size_t group = GetFirstGroup(mixedHash);
+
+        INSTRUMENT(size_t probes = 0;)
+        for (;;)
+        {
+            INSTRUMENT(probes++;)
+            size_t firstSlot = group * SWISS_GROUP_SIZE;
+            unsigned int emptyMask;
+            unsigned int tagMask = _match(&_control[firstSlot], tag, emptyMask);
+            while (tagMask)
+            {
+                size_t slot = (firstSlot + GetLowestBit(tagMask)) & slotMask;
+                if (Storage::IsWord(_arena, _values[slot], word))
+                {
+                    INSTRUMENT(g_lookupStats.RecordProbes(probes);)
+                    return (int)slot;
+                }
+                tagMask &= tagMask - 1;
+            }
+            if (emptyMask)
+            {
+                INSTRUMENT(g_lookupStats.RecordProbes(probes);)
+                return -1;
+            }
+            group = (group + _groupsPerMatch) & _groupMask;
+        }
+    }
+
+    // insert a word known not to be in the table
+    void    Insert(HashValue hash, StringRef word)
+    {
+        unsigned long long mixedHash = MixHash(hash);
+        size_t slotMask = _values.size() - 1;
+        size_t group = GetFirstGroup(mixedHash);
+
+        for (;;)
+        {
+            size_t firstSlot = group * SWISS_GROUP_SIZE;
+            unsigned int emptyMask;
+            _match(&_control[firstSlot], SWISS_EMPTY, emptyMask);
+            if (emptyMask)
+            {
+                size_t slot = (firstSlot + GetLowestBit(emptyMask)) & slotMask;
+                SetControl(slot, GetTag(mixedHash));
+                _values[slot] = Storage::Store(_arena, word);
+                _count++;
+                return;
+            }
+            group = (group + _groupsPerMatch) & _groupMask;
+        }
+    }
+
+    void    SetControl(size_t slot, unsigned char value)
+    {
+        _control[slot] = value;
+        if (slot < SWISS_GROUP_SIZE)
+        {
+            // keep the copy of the first group after the last one up to date
+            _control[_values.size() + slot] = value;
+        }
+    }
+
+    SimdLevel               _simdLevel;
+    SwissMatchFunction      _match;
+    size_t                  _groupsPerMatch;    // groups compared by each call to _match
+    string                  _name;
+    int                     _count;
+    size_t                  _groupMask;
+    vector<unsigned char>   _control;           // EMPTY or fingerprint for each slot
+    vector<Value>           _values;            // the word stored in each slot
+};
+
+// A minimal perfect hash map for static dictionaries, built PTHash-style.
+// Every word is given its own slot in an array exactly as long as the dictionary, so
+// a lookup is one hash, one slot read and one string compare, with no probing and no
+// buckets to search.
+// Words are first split between about n/3 buckets, most of them into the first 30%
+// of buckets so that a few buckets are large. Then, largest first, each bucket is given
+// the first "pilot" value that sends all of its words to slots nobody has yet. The
+// pilot is all that's stored per bucket: usually one byte, so under 3 bits per word.
+// The rare pilots that don't fit in a byte are kept in a small sorted overflow table.
+// Pilots are searched for over a table 1% larger than the dictionary, as the last few
+// words would need huge pilots to find the last few free slots. Words that land past
+// the end are then moved down into the slots left free, through a small remap table.
+// Words whose hashes are identical can't be told apart by any pilot, so all but one of
+// them go in a small overflow list.
+template <class Hash = StringHashPolicy>
+class PerfectHashMap : public HashMapBase
+{
+public:
+    PerfectHashMap()
+        : _numBuckets(0)
+        , _numDenseBuckets(0)
+        , _tableSize(0)
+    {
+        _name = string("PerfectHashMap<") + Hash::GetName() + ">";
+    }
+
+    virtual ~PerfectHashMap()
+    {
+    }
+
+    void    CreateMap(Dictionary* dictionary)
+    {
+        _arena = dictionary->GetArena();
+        chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+
+        // sort the words by hash, dropping repeats of the same word and moving words that
+        // only share a hash to the overflow list
+        int size = dictionary->GetSize();
+        INSTRUMENT(StartBuildPhase("hash");)
+        vector< pair<HashValue, int> > keys;
+        keys.reserve(size);
+        for (int loop = 0; loop < size; loop++)
+        {
+            HashValue hash = Mix64(Hash::HashEntry(dictionary->GetKVPair(loop), dictionary->GetString(loop)));
+            keys.push_back(make_pair(hash, loop));
+        }
+        INSTRUMENT(StartBuildPhase("sort");)
+        sort(keys.begin(), keys.end());
+
+        INSTRUMENT(StartBuildPhase("resolve collisions");)
+        vector< pair<HashValue, StringRef> > entries;
+        entries.reserve(size);
+        _overflow.clear();
+        for (int loop = 0; loop < size; loop++)
+        {
+            const KVPair& kvPair = dictionary->GetKVPair(keys[loop].second);
+            if (!entries.empty() && entries.back().first == keys[loop].first)
+            {
+                if (_arena->Get(entries.back().second) != dictionary->GetString(keys[loop].second) &&
+                    !FindOverflow(keys[loop].first, dictionary->GetString(keys[loop].second)))
+                {
+                    _overflow.push_back(make_pair(keys[loop].first, kvPair._value));
+                }
+                continue;
+            }
+            entries.push_back(make_pair(keys[loop].first, kvPair._value));
+        }
+
+        INSTRUMENT(StartBuildPhase("find pilots");)
+        Build(entries);
+        INSTRUMENT(StartBuildPhase(NULL);)
+
+        chrono::steady_clock::duration buildTime = chrono::steady_clock::now() - startTime;
+        double bitsPerKey = (_pilots.size() * 8.0 + _largePilots.size() * sizeof(_largePilots[0]) * 8.0 + _remap.size() * 32.0) / max<size_t>(_slots.size(), 1);
+        cout << "Perfect hash of " << _slots.size() << " words: " << bitsPerKey << " bits/word, "
+             << _largePilots.size() << " large pilots, built in " << chrono::duration<double, milli>(buildTime).count() << "ms" << endl;
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return Hash::Hash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(Hash::Hash(wordToFind), wordToFind);
+    }
+
+    void    Prefetch(HashValue key, const string& ) const
+    {
+        if (!_slots.empty())
+        {
+            PREFETCH(&_pilots[GetBucket(Mix64(key))]);
+        }
+    }
+
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        HashValue hash = Mix64(key);
+        if (_slots.empty())
+            return FindOverflow(hash, wordToFind);
+
+        size_t slot = GetSlot(hash, GetPilot(GetBucket(hash)));
+        if (_arena->Get(_slots[slot]) == wordToFind)
+            return true;
+        return !_overflow.empty() && FindOverflow(hash, wordToFind);
+    }
+
+private:
+    static const int            AVERAGE_BUCKET_SIZE = 3;
+    static const int            TABLE_PERCENT = 101;    // size of the table pilots are found over
+    static const unsigned char  LARGE_PILOT = 0xFF;     // the pilot is in _largePilots
+
+    // 60% of hashes go to the first 30% of buckets
+    size_t  GetBucket(HashValue hash) const
+    {
+        static const unsigned long long DENSE_THRESHOLD = (unsigned long long)(0.6 * 4294967296.0);
+        if ((hash & 0xFFFFFFFF) < DENSE_THRESHOLD)
+        {
+            return (size_t)MultiplyHigh(hash, _numDenseBuckets);
+        }
+        return _numDenseBuckets + (size_t)MultiplyHigh(hash, _numBuckets - _numDenseBuckets);
+    }
+
+    size_t  GetPosition(HashValue hash, unsigned int pilot) const
+    {
+        return (size_t)MultiplyHigh(Mix64(hash ^ Mix64(pilot + 1)), _tableSize);
+    }
+
+    size_t  GetSlot(HashValue hash, unsigned int pilot) const
+    {
+        size_t position = GetPosition(hash, pilot);
+        if (position < _slots.size())
+            return position;
+        return _remap[position - _slots.size()];
+    }
+
+    unsigned int    GetPilot(size_t bucket) const
+    {
+        unsigned char pilot = _pilots[bucket];
+        if (pilot != LARGE_PILOT)
+            return pilot;
+
+        vector< pair<unsigned int, unsigned int> >::const_iterator it;
+        it = lower_bound(_largePilots.begin(), _largePilots.end(), make_pair((unsigned int)bucket, 0u));
+        return it->second;
+    }
+
+    // return true if "word", whose mixed hash is "hash", is in the overflow list.
+    // The list is in hash order, as the words were added in hash order. Only a lookup
+    // that finds words with its hash in the list counts as chained
+    bool    FindOverflow(HashValue hash, string_view word) const
+    {
+        vector< pair<HashValue, StringRef> >::const_iterator it;
+        it = lower_bound(_overflow.begin(), _overflow.end(), make_pair(hash, StringRef()),
+                         [](const pair<HashValue, StringRef>& a, const pair<HashValue, StringRef>& b) { return a.first < b.first; });
+        INSTRUMENT(if (it != _overflow.end() && it->first == hash) g_lookupStats.RecordChained();)
+        for (; it != _overflow.end() && it->first == hash; ++it)
+        {
+            if (_arena->Get(it->second) == word)
+                return true;
+        }
+        return false;
+    }
+
+    // Find a pilot for every bucket. "entries" are sorted by hash with no repeats
+    void    Build(const vector< pair<HashValue, StringRef> >& entries)
+    {
+        size_t size = entries.size();
+        _slots.assign(size, StringRef());
+        _tableSize = max<size_t>(size * TABLE_PERCENT / 100, size);
+        _numBuckets = max<size_t>((size + AVERAGE_BUCKET_SIZE - 1) / AVERAGE_BUCKET_SIZE, 1);
+        _numDenseBuckets = max<size_t>(_numBuckets * 3 / 10, 1);
+        _pilots.assign(_numBuckets, 0);
+        _largePilots.clear();
+        _remap.clear();
+        if (size == 0)
+            return;
+
+        // counting sort the entries into buckets
+        vector<unsigned int> bucketStart(_numBuckets + 1, 0);
+        for (size_t loop = 0; loop < size; loop++)
+        {
+            bucketStart[GetBucket(entries[loop].first) + 1]++;
+        }
+        for (size_t bucket = 0; bucket < _numBuckets; bucket++)
+        {
+            bucketStart[bucket + 1] += bucketStart[bucket];
+        }
+        vector<unsigned int> bucketEntries(size);
+        vector<unsigned int> bucketFill(bucketStart.begin(), bucketStart.end() - 1);
+        for (size_t loop = 0; loop < size; loop++)
+        {
+            bucketEntries[bucketFill[GetBucket(entries[loop].first)]++] = (unsigned int)loop;
+        }
+
+        // largest buckets first, while there's the most room
+        vector< pair<unsigned int, unsigned int> > bucketOrder;
+        for (size_t bucket = 0; bucket < _numBuckets; bucket++)
+        {
+            unsigned int bucketSize = bucketStart[bucket + 1] - bucketStart[bucket];
+            if (bucketSize > 0)
+            {
+                bucketOrder.push_back(make_pair(bucketSize, (unsigned int)bucket));
+            }
+        }
+        sort(bucketOrder.rbegin(), bucketOrder.rend());
+
+        vector<bool>    taken(_tableSize, false);
+        vector<size_t>  positions;
+        vector<StringRef>   table(_tableSize);
+        for (size_t order = 0; order < bucketOrder.size(); order++)
+        {
+            unsigned int bucket = bucketOrder[order].second;
+            unsigned int first = bucketStart[bucket];
+            unsigned int last = bucketStart[bucket + 1];
+
+            for (unsigned int pilot = 0; ; pilot++)
+            {
+                positions.clear();
+                bool fits = true;
+                for (unsigned int loop = first; loop < last && fits; loop++)
+                {
+                    size_t slot = GetPosition(entries[bucketEntries[loop]].first, pilot);
+                    fits = !taken[slot] && find(positions.begin(), positions.end(), slot) == positions.end();
+                    positions.push_back(slot);
+                }
+                if (!fits)
+                    continue;
+
+                for (unsigned int loop = first; loop < last; loop++)
+                {
+                    size_t slot = positions[loop - first];
+                    taken[slot] = true;
+                    table[slot] = entries[bucketEntries[loop]].second;
+                }
+                if (pilot < LARGE_PILOT)
+                {
+                    _pilots[bucket] = (unsigned char)pilot;
+                }
+                else
+                {
+                    _pilots[bucket] = LARGE_PILOT;
+                    _largePilots.push_back(make_pair(bucket, pilot));
+                }
+                break;
+            }
+        }
+        sort(_largePilots.begin(), _largePilots.end());
+
+        // move everything past the end of the dictionary into the free slots below it
+        _remap.assign(_tableSize - size, 0);
+        size_t freeSlot = 0;
+        for (size_t position = 0; position < _tableSize; position++)
+        {
+            if (!taken[position])
+                continue;
+
+            if (position < size)
+            {
+                _slots[position] = table[position];
+            }
+            else
+            {
+                while (taken[freeSlot])
+                {
+                    freeSlot++;
+                }
+                _slots[freeSlot] = table[position];
+                _remap[position - size] = (unsigned int)freeSlot;
+                freeSlot++;
+            }
+        }
+    }
+
+    string                  _name;
+    size_t                  _numBuckets;
+    size_t                  _numDenseBuckets;
+    size_t                  _tableSize;
+    vector<unsigned char>   _pilots;            // pilot for each bucket, or LARGE_PILOT
+    vector< pair<unsigned int, unsigned int> >  _largePilots;   // bucket and pilot, sorted by bucket
+    vector<StringRef>       _slots;             // the word in each slot
+    vector<unsigned int>    _remap;             // slot for each position past the end of _slots
+    vector< pair<HashValue, StringRef> >    _overflow;  // words sharing a hash with a word in _slots, by hash
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Map served straight from an index file mapped into memory
+//
+// The index file is written once by CreateMap and from then on can be mapped read-only
+// by Open, so a process can start answering lookups without reading the word list or
+// building anything. Load only checks the header, and pages of the slots and blob are
+// only read in as lookups touch them, so each slot is checked against the blob as a
+// lookup reads it. Every process mapping the same file shares one copy of it. The
+// header records the size and modification time of the word list the index was built
+// from, so it is rebuilt when the word list changes, without reading it to find out.
+//
+// The layout is an IndexHeader, the slots of an open-addressed table with linear probing
+// and then a blob holding every word, NUL-terminated. Everything in the file is found by
+// offsets from the start of the file or of the blob, never by pointers, so the file can
+// be mapped at any address. Values are stored in native byte order.
+
+static const char           INDEX_MAGIC[8] = { 'D', 'H', 'M', 'I', 'N', 'D', 'E', 'X' };
+static const unsigned int   INDEX_VERSION = 3;
+
+struct IndexHeader
+{
+    char                _magic[8];      // INDEX_MAGIC
+    unsigned int        _version;       // INDEX_VERSION when written
+    unsigned int        _hashId;        // Id of the hash policy the slots were hashed with
+    unsigned long long  _sourceSize;        // bytes in the word list the index was built from
+    unsigned long long  _sourceModified;    // GetFileStamp time of that word list
+    unsigned long long  _numWords;      // distinct words in the index
+    unsigned long long  _numSlots;      // a power of two
+    unsigned long long  _slotsOffset;   // from the start of the file
+    unsigned long long  _blobOffset;    // from the start of the file
+    unsigned long long  _blobSize;
+};
+
+// An empty slot has a _length of 0
+struct IndexSlot
+{
+    HashValue       _hash;
+    unsigned int    _offset;            // from the start of the blob
+    unsigned int    _length;
+};
+
+template <class Hash = StringHashPolicy>
+class MappedIndexMap : public HashMapBase
+{
+public:
+    MappedIndexMap(const char* fileName, const char* sourceFileName)
+        : _fileName(fileName)
+        , _sourceFileName(sourceFileName)
+        , _header(NULL)
+        , _slots(NULL)
+        , _blob(NULL)
+        , _blobSize(0)
+        , _mask(0)
+    {
+        _name = string("MappedIndexMap<") + Hash::GetName() + ">";
+    }
+
+    virtual ~MappedIndexMap()
+    {
+    }
+
+    // Map the index in the file if it is up to date with the word list, otherwise build
+    // it from "dictionary", which must have been read from the word list, write it to
+    // the file and map that
+    void    CreateMap(Dictionary* dictionary)
+    {
+        chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+        if (Open())
+        {
+            chrono::steady_clock::duration loadTime = chrono::steady_clock::now() - startTime;
+            cout << "Mapped index " << _fileName << " of " << _header->_numWords << " words in "
+                 << chrono::duration<double, milli>(loadTime).count() << "ms" << endl;
+            return;
+        }
+
+        Build(dictionary);
+        if (!Write(_fileName.c_str()))
+        {
+            cout << "Unable to write index " << _fileName << ", using it from memory" << endl;
+            return;
+        }
+        if (!Load(_fileName.c_str()))
+        {
+            cout << "Unable to map index " << _fileName << ", using it from memory" << endl;
+            return;
+        }
+        _ownSlots = vector<IndexSlot>();
+        _ownBlob = vector<char>();
+
+        chrono::steady_clock::duration buildTime = chrono::steady_clock::now() - startTime;
+        cout << "Wrote index " << _fileName << " of " << _header->_numWords << " words, "
+             << _file.GetSize() << " bytes in " << chrono::duration<double, milli>(buildTime).count() << "ms" << endl;
+    }
+
+    // Map the index file if it was built from the word list as it is now, judged by the
+    // word list's size and modification time alone, so neither file is read through
+    // return false, leaving the map empty, if there is no such index and it has to be
+    // built by CreateMap
+    bool    Open()
+    {
+        unsigned long long size;
+        unsigned long long modified;
+        if (!GetFileStamp(_sourceFileName.c_str(), size, modified) || !Load(_fileName.c_str()))
+            return false;
+        if (_header->_sourceSize == size && _header->_sourceModified == modified)
+            return true;
+
+        _file.Close();
+        _header = NULL;
+        _slots = NULL;
+        _blob = NULL;
+        _blobSize = 0;
+        _mask = 0;
+        return false;
+    }
+
+    // Map the index in "fileName" read-only and serve lookups from it.
+    // return false, leaving the map as it was, if the file is missing, was written by a
+    // different version or hash function, or is too short for the slots and blob its
+    // header gives. Only the header is read; the slots are checked by FindHashed
+    bool    Load(const char* fileName)
+    {
+        MappedFile file;
+        if (!file.Open(fileName) || file.GetSize() < sizeof(IndexHeader))
+            return false;
+
+        const IndexHeader* header = (const IndexHeader*)file.GetData();
+        unsigned long long size = file.GetSize();
+        if (memcmp(header->_magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->_version != INDEX_VERSION ||
+            header->_hashId != Hash::Id)
+            return false;
+        if (header->_numSlots == 0 || (header->_numSlots & (header->_numSlots - 1)) != 0 ||
+            header->_numSlots > size / sizeof(IndexSlot) || header->_slotsOffset % alignof(IndexSlot) != 0 ||
+            header->_slotsOffset > size - header->_numSlots * sizeof(IndexSlot) ||
+            header->_blobOffset > size || header->_blobSize > size - header->_blobOffset)
+            return false;
+
+        _file.Swap(file);
+        _header = (const IndexHeader*)_file.GetData();
+        _slots = (const IndexSlot*)(_file.GetData() + _header->_slotsOffset);
+        _blob = _file.GetData() + _header->_blobOffset;
+        _blobSize = _header->_blobSize;
+        _mask = (size_t)_header->_numSlots - 1;
+        return true;
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    bool    RefersToDictionaryArena() const
+    {
+        return false;
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return Hash::Hash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(Hash::Hash(wordToFind), wordToFind);
+    }
+
+    void    Prefetch(HashValue key, const string& ) const
+    {
+        if (_slots)
+        {
+            PREFETCH(&_slots[Mix64(key) & _mask]);
+        }
+    }
+
+    // The file isn't trusted beyond its header: a slot pointing outside the blob never
+    // matches, and the probe stops after every slot even if none is empty
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        if (_slots == NULL)
+            return false;
+
+        INSTRUMENT(size_t probes = 1;)
+        size_t slot = Mix64(key) & _mask;
+        for (size_t probe = 0; probe <= _mask && _slots[slot]._length != 0; probe++, slot = (slot + 1) & _mask)
+        {
+            const IndexSlot& indexSlot = _slots[slot];
+            if (indexSlot._hash == key && indexSlot._length == wordToFind.size() &&
+                (unsigned long long)indexSlot._offset + indexSlot._length <= _blobSize &&
+                memcmp(_blob + indexSlot._offset, wordToFind.data(), indexSlot._length) == 0)
+            {
+                INSTRUMENT(g_lookupStats.RecordProbes(probes);)
+                return true;
+            }
+            INSTRUMENT(probes++;)
+        }
+        INSTRUMENT(g_lookupStats.RecordProbes(probes);)
+        return false;
+    }
+
+private:
+    // Build the index in memory, in _ownHeader, _ownSlots and _ownBlob. Words are
+    // compared in full, so words sharing a hash need no collision table
+    void    Build(Dictionary* dictionary)
+    {
+        unsigned long long sourceSize = 0;
+        unsigned long long sourceModified = 0;
+        GetFileStamp(_sourceFileName.c_str(), sourceSize, sourceModified);
+
+        int size = dictionary->GetSize();
+        size_t numSlots = 1;
+        while (numSlots < (size_t)size * 2)
+        {
+            numSlots <<= 1;
+        }
+
+        _ownSlots.assign(numSlots, IndexSlot());
+        _ownBlob.clear();
+        _ownBlob.reserve(dictionary->GetArena()->GetSize());
+        _mask = numSlots - 1;
+        size_t numWords = 0;
+        for (int loop = 0; loop < size; loop++)
+        {
+            string_view word = dictionary->GetString(loop);
+            HashValue hash = Hash::HashEntry(dictionary->GetKVPair(loop), word);
+            size_t slot = Mix64(hash) & _mask;
+            while (_ownSlots[slot]._length != 0 &&
+                   !(_ownSlots[slot]._hash == hash && string_view(&_ownBlob[_ownSlots[slot]._offset], _ownSlots[slot]._length) == word))
+            {
+                slot = (slot + 1) & _mask;
+            }
+            if (_ownSlots[slot]._length != 0)
+                continue;
+
+            _ownSlots[slot]._hash = hash;
+            _ownSlots[slot]._offset = (unsigned int)_ownBlob.size();
+            _ownSlots[slot]._length = (unsigned int)word.size();
+            _ownBlob.insert(_ownBlob.end(), word.begin(), word.end());
+            _ownBlob.push_back('\0');
+            numWords++;
+        }
+
+        memset(&_ownHeader, 0, sizeof(_ownHeader));
+        memcpy(_ownHeader._magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        _ownHeader._version = INDEX_VERSION;
+        _ownHeader._hashId = Hash::Id;
+        _ownHeader._sourceSize = sourceSize;
+        _ownHeader._sourceModified = sourceModified;
+        _ownHeader._numWords = numWords;
+        _ownHeader._numSlots = numSlots;
+        _ownHeader._slotsOffset = sizeof(IndexHeader);
+        _ownHeader._blobOffset = _ownHeader._slotsOffset + numSlots * sizeof(IndexSlot);
+        _ownHeader._blobSize = _ownBlob.size();
+
+        _file.Close();
+        _header = &_ownHeader;
+        _slots = &_ownSlots[0];
+        _blob = _ownBlob.empty() ? NULL : &_ownBlob[0];
+        _blobSize = _ownBlob.size();
+    }
+
+    // Write the index built by Build to "fileName"
+    bool    Write(const char* fileName) const
+    {
+        ofstream file(fileName, ios::binary | ios::trunc);
+        file.write((const char*)&_ownHeader, sizeof(_ownHeader));
+        file.write((const char*)&_ownSlots[0], _ownSlots.size() * sizeof(IndexSlot));
+        file.write(_ownBlob.data(), _ownBlob.size());
+        file.close();
+        return !file.fail();
+    }
+
+    string              _name;
+    string              _fileName;
+    string              _sourceFileName;    // the word list the index is built from
+    MappedFile          _file;
+    const IndexHeader*  _header;
+    const IndexSlot*    _slots;         // in _file, or _ownSlots if the file couldn't be used
+    const char*         _blob;
+    unsigned long long  _blobSize;      // bytes at _blob that slots can point into
+    size_t              _mask;          // number of slots - 1
+    IndexHeader         _ownHeader;
+    vector<IndexSlot>   _ownSlots;
+    vector<char>        _ownBlob;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// A hash map that can be read and written by many threads at once
+//
+// The words are split over a number of shards by the top bits of their mixed hash, as
+// in the other sharded maps, each a RobinHoodMap with its own reader/writer lock. The
+// RobinHoodMap places words by the unmixed hash, so each shard's table is still evenly
+// filled. Any number of Finds can run on a shard together, and an Insert or Erase only
+// locks out the one shard it changes, so with enough shards writers rarely hold up
+// readers, unlike a single lock around the whole map.
+// Each shard is on its own cache lines, so taking one shard's lock doesn't disturb
+// threads using its neighbours.
+// Each shard keeps its own copy of its words in its own arena, as a shared arena
+// couldn't be added to by several writers at once. The arena's chunks are sized for the
+// shard's share of the dictionary, so many shards don't each hold a full-size chunk, and
+// the shard's RobinHoodMap compacts it once erased words are half of it and more than
+// its share of what a single map waits for.
+
+template <class Hash = StringHashPolicy>
+class ConcurrentHashMap : public HashMapBase
+{
+public:
+    // "numShards" is rounded up to a power of two
+    ConcurrentHashMap(int numShards = 64)
+        : _shardBits(GetShardBits(numShards))
+        , _shards((size_t)1 << _shardBits)
+    {
+        _name = string("ConcurrentHashMap<") + Hash::GetName() + ">(" + to_string(_shards.size()) + " shards)";
+    }
+
+    virtual ~ConcurrentHashMap()
+    {
+    }
+
+    // The words are hashed and split between the shards in parallel, and then the
+    // shards are filled in parallel with the hashes already calculated
+    void    CreateMap(Dictionary* dictionary)
+    {
+        int numShards = _shards.size();
+        WorkStealingPool& pool = GetThreadPool();
+        Partitions partitions;
+        PartitionByShard<Hash>(dictionary, pool, _shardBits, partitions);
+
+        vector< function<void()> > tasks;
+        for (int shard = 0; shard < numShards; shard++)
+        {
+            tasks.push_back([this, dictionary, numShards, shard, &partitions]()
+            {
+                Shard& current = _shards[shard];
+                unique_lock<shared_mutex> lock(current._lock);
+                const vector<PartitionWord>& words = partitions[shard];
+                size_t wordBytes = 0;
+                for (size_t loop = 0; loop < words.size(); loop++)
+                {
+                    wordBytes += dictionary->GetString(words[loop]._index).size() + 1;
+                }
+                current._map.SetArenaSizes(wordBytes, MIN_COMPACT_ARENA_SIZE / numShards);
+                for (size_t loop = 0; loop < words.size(); loop++)
+                {
+                    current._map.InsertHashed(words[loop]._hash, dictionary->GetString(words[loop]._index));
+                }
+            });
+        }
+        pool.Run(tasks);
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    bool    RefersToDictionaryArena() const
+    {
+        return false;
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return Hash::Hash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(Hash::Hash(wordToFind), wordToFind);
+    }
+
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        const Shard& shard = _shards[GetShardIndex(key, _shardBits)];
+        shared_lock<shared_mutex> lock(shard._lock);
+        return shard._map.FindHashed(key, wordToFind);
+    }
+
+    // return the bytes held by the shards' arenas
+    size_t  GetArenaSize() const
+    {
+        size_t size = 0;
+        for (size_t loop = 0; loop < _shards.size(); loop++)
+        {
+            shared_lock<shared_mutex> lock(_shards[loop]._lock);
+            size += _shards[loop]._map.GetArenaSize();
+        }
+        return size;
+    }
+
+    // Insert "word", safe to call while other threads use the map
+    // return true if it was added, false if it was already there
+    bool    Insert(string_view word)
+    {
+        HashValue key = Hash::Hash(word);
+        Shard& shard = _shards[GetShardIndex(key, _shardBits)];
+        unique_lock<shared_mutex> lock(shard._lock);
+        return shard._map.InsertHashed(key, word);
+    }
+
+    // Remove "word", safe to call while other threads use the map
+    // return true if it was removed, false if it wasn't there
+    bool    Erase(string_view word)
+    {
+        Shard& shard = _shards[GetShardIndex(Hash::Hash(word), _shardBits)];
+        unique_lock<shared_mutex> lock(shard._lock);
+        return shard._map.Erase(word);
+    }
+
+private:
+    struct alignas(64) Shard
+    {
+        mutable shared_mutex    _lock;
+        RobinHoodMap<Hash>      _map;
+    };
+
+    string          _name;
+    int             _shardBits;     // shards are picked by HashMapBase::GetShardIndex
+    vector<Shard>   _shards;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Adaptive radix tree
+//
+// A trie keyed on the bytes of the words rather than on a hash, so unlike the hash maps
+// it keeps the words in order and can answer prefix queries and range scans without
+// looking at every word.
+// Each inner node is the smallest of four kinds that holds its children. Node4 and
+// Node16 keep a sorted array of key bytes, Node16's searched with one SSE2 compare,
+// Node48 has a 256-entry index into 48 children and Node256 a child for every byte.
+// A run of nodes with only one child is collapsed into a prefix on the node below. Only
+// the first RADIX_PREFIX_SIZE bytes of a prefix are kept in the node; lookups skip the
+// rest, as the word is compared in full at the leaf, and inserts and scans that need it
+// read it from any word below the node.
+// A leaf is the StringRef of its word packed into the child pointer and tagged in the
+// low bit, so leaves take no memory of their own. Every word is followed by a 0 byte,
+// which can't be in a word, so one word being the start of another needs no special case.
+// The dictionary drops lines with a 0 byte in them, and Insert refuses such words.
+
+static const unsigned int   RADIX_PREFIX_SIZE = 8;
+
+enum RadixNodeType
+{
+    RADIX_NODE4,
+    RADIX_NODE16,
+    RADIX_NODE48,
+    RADIX_NODE256,
+    NUM_RADIX_NODE_TYPES
+};
+
+// A RadixNode*, or a leaf if the low bit is set. 0 is no child
+typedef unsigned long long  RadixChild;
+
+struct RadixNode
+{
+    unsigned char   _type;
+    unsigned short  _count;                         // number of children
+    unsigned int    _prefixLength;
+    unsigned char   _prefix[RADIX_PREFIX_SIZE];     // the first bytes of the prefix
+};
+
+struct RadixNode4 : RadixNode
+{
+    unsigned char   _keys[4];
+    RadixChild      _children[4];
+};
+
+struct RadixNode16 : RadixNode
+{
+    unsigned char   _keys[16];
+    RadixChild      _children[16];
+};
+
+struct RadixNode48 : RadixNode
+{
+    unsigned char   _childIndex[256];               // 1 + index into _children, or 0 for none
+    RadixChild      _children[48];
+};
+
+struct RadixNode256 : RadixNode
+{
+    RadixChild      _children[256];
+};
+
+class RadixTreeMap : public HashMapBase
+{
+public:
+    RadixTreeMap()
+        : _root(0)
+    {
+        for (int loop = 0; loop < NUM_RADIX_NODE_TYPES; loop++)
+        {
+            _nodeCounts[loop] = 0;
+        }
+    }
+
+    virtual ~RadixTreeMap()
+    {
+        DeleteTree(_root);
+    }
+
+    void    CreateMap(Dictionary* dictionary)
+    {
+        _arena = dictionary->GetArena();
+        int size = dictionary->GetSize();
+        for (int loop = 0; loop < size; loop++)
+        {
+            InsertAt(_root, dictionary->GetString(loop), dictionary->GetKVPair(loop)._value, 0);
+        }
+
+        cout << "Radix tree nodes: " << _nodeCounts[RADIX_NODE4] << " Node4, " << _nodeCounts[RADIX_NODE16] << " Node16, "
+             << _nodeCounts[RADIX_NODE48] << " Node48, " << _nodeCounts[RADIX_NODE256] << " Node256, "
+             << GetNodeBytes() << " bytes" << endl;
+    }
+
+    const char* GetName() const
+    {
+        return "RadixTreeMap";
+    }
+
+    bool    RefersToDictionaryArena() const
+    {
+        return false;
+    }
+
+    // the tree is keyed on the word itself, so there's no hash
+    HashValue   GetHash(const string& ) const
+    {
+        return 0;
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(0, wordToFind);
+    }
+
+    bool    FindHashed(HashValue , const string& wordToFind) const
+    {
+        string_view word(wordToFind);
+        RadixChild child = _root;
+        size_t depth = 0;
+        INSTRUMENT(size_t nodes = 0;)
+        while (child && !IsLeaf(child))
+        {
+            INSTRUMENT(nodes++;)
+            const RadixNode* node = GetNode(child);
+            unsigned int stored = min(node->_prefixLength, RADIX_PREFIX_SIZE);
+            for (unsigned int loop = 0; loop < stored; loop++)
+            {
+                if (GetKeyByte(word, depth + loop) != node->_prefix[loop])
+                {
+                    INSTRUMENT(g_lookupStats.RecordProbes(nodes);)
+                    return false;
+                }
+            }
+            depth += node->_prefixLength;
+            if (depth > word.size())
+            {
+                INSTRUMENT(g_lookupStats.RecordProbes(nodes);)
+                return false;
+            }
+            child = FindChild(node, GetKeyByte(word, depth));
+            depth++;
+        }
+        INSTRUMENT(g_lookupStats.RecordProbes(nodes);)
+        return child && GetLeafWord(child) == word;
+    }
+
+    // Add a copy of "word" to the map
+    // return true if it was added, false if it was already there or holds a 0 byte
+    bool    Insert(string_view word)
+    {
+        if (word.find('\0') != string_view::npos || Find(string(word)))
+        {
+            return false;
+        }
+        return InsertAt(_root, word, GetInsertArena()->Add(word), 0);
+    }
+
+    // Call "callback" with every word starting with "prefix", in order
+    // return the number of words
+    template <class Callback>
+    int     FindPrefix(string_view prefix, Callback callback) const
+    {
+        RadixChild child = _root;
+        size_t depth = 0;
+        while (child && !IsLeaf(child) && depth < prefix.size())
+        {
+            string_view nodePrefix = GetPrefix(child, depth);
+            size_t length = min(nodePrefix.size(), prefix.size() - depth);
+            if (nodePrefix.substr(0, length) != prefix.substr(depth, length))
+            {
+                return 0;
+            }
+            depth += nodePrefix.size();
+            if (depth >= prefix.size())
+            {
+                break;
+            }
+            child = FindChild(GetNode(child), (unsigned char)prefix[depth]);
+            depth++;
+        }
+
+        int count = 0;
+        auto visit = [&](string_view word)
+        {
+            callback(word);
+            count++;
+            return true;
+        };
+        if (child && IsLeaf(child))
+        {
+            string_view word = GetLeafWord(child);
+            if (word.substr(0, prefix.size()) == prefix)
+            {
+                visit(word);
+            }
+        }
+        else if (child)
+        {
+            VisitAll(child, visit);
+        }
+        return count;
+    }
+
+    // Call "callback" with each word in order, from the first that isn't before "first",
+    // until it returns false
+    template <class Callback>
+    void    Scan(string_view first, Callback callback) const
+    {
+        if (_root)
+        {
+            VisitFrom(_root, first, 0, callback);
+        }
+    }
+
+    // Call "callback" with each word from "first" up to but not including "last", in order
+    // return the number of words
+    template <class Callback>
+    int     ScanRange(string_view first, string_view last, Callback callback) const
+    {
+        int count = 0;
+        Scan(first, [&](string_view word)
+        {
+            if (word >= last)
+            {
+                return false;
+            }
+            callback(word);
+            count++;
+            return true;
+        });
+        return count;
+    }
+
+    // return the memory used by the inner nodes. Leaves have none of their own
+    size_t  GetNodeBytes() const
+    {
+        return _nodeCounts[RADIX_NODE4] * sizeof(RadixNode4) + _nodeCounts[RADIX_NODE16] * sizeof(RadixNode16)
+             + _nodeCounts[RADIX_NODE48] * sizeof(RadixNode48) + _nodeCounts[RADIX_NODE256] * sizeof(RadixNode256);
+    }
+
+private:
+    static bool IsLeaf(RadixChild child)
+    {
+        return (child & 1) != 0;
+    }
+
+    static RadixChild   MakeLeaf(StringRef ref)
+    {
+        return ((RadixChild)ref._offset << 32) | ((RadixChild)ref._length << 1) | 1;
+    }
+
+    static RadixNode*   GetNode(RadixChild child)
+    {
+        return (RadixNode*)(uintptr_t)child;
+    }
+
+    static RadixChild   MakeChild(RadixNode* node)
+    {
+        return (RadixChild)(uintptr_t)node;
+    }
+
+    string_view GetLeafWord(RadixChild child) const
+    {
+        StringRef ref;
+        ref._offset = (unsigned int)(child >> 32);
+        ref._length = (unsigned int)(child & 0xffffffff) >> 1;
+        return _arena->Get(ref);
+    }
+
+    // the byte of "word" at "position", with 0 for the end of the word and beyond
+    static unsigned char    GetKeyByte(string_view word, size_t position)
+    {
+        return position < word.size() ? (unsigned char)word[position] : 0;
+    }
+
+    // return the whole prefix of the node "child", which is at "depth" in the tree
+    string_view GetPrefix(RadixChild child, size_t depth) const
+    {
+        const RadixNode* node = GetNode(child);
+        if (node->_prefixLength <= RADIX_PREFIX_SIZE)
+        {
+            return string_view((const char*)node->_prefix, node->_prefixLength);
+        }
+        return GetLeafWord(GetFirstLeaf(child)).substr(depth, node->_prefixLength);
+    }
+
+    static void SetPrefix(RadixNode* node, const char* prefix, size_t length)
+    {
+        node->_prefixLength = (unsigned int)length;
+        memcpy(node->_prefix, prefix, min(length, (size_t)RADIX_PREFIX_SIZE));
+    }
+
+    static RadixChild   GetFirstLeaf(RadixChild child)
+    {
+        while (!IsLeaf(child))
+        {
+            child = GetFirstChild(GetNode(child));
+        }
+        return child;
+    }
+
+    static RadixChild   GetFirstChild(const RadixNode* node)
+    {
+        switch (node->_type)
+        {
+        case RADIX_NODE4:
+            return ((const RadixNode4*)node)->_children[0];
+        case RADIX_NODE16:
+            return ((const RadixNode16*)node)->_children[0];
+        case RADIX_NODE48:
+        {
+            const RadixNode48* node48 = (const RadixNode48*)node;
+            for (int byte = 0; ; byte++)
+            {
+                if (node48->_childIndex[byte])
+                {
+                    return node48->_children[node48->_childIndex[byte] - 1];
+                }
+            }
+        }
+        default:
+        {
+            const RadixNode256* node256 = (const RadixNode256*)node;
+            for (int byte = 0; ; byte++)
+            {
+                if (node256->_children[byte])
+                {
+                    return node256->_children[byte];
+                }
+            }
+        }
+        }
+    }
+
+    static RadixChild   FindChild(const RadixNode* node, unsigned char byte)
+    {
+        const RadixChild* child = FindChildSlot(const_cast<RadixNode*>(node), byte);
+        return child ? *child : 0;
+    }
+
+    // return where the child for "byte" is kept, or NULL if there isn't one
+    static RadixChild*  FindChildSlot(RadixNode* node, unsigned char byte)
+    {
+        switch (node->_type)
+        {
+        case RADIX_NODE4:
+        {
+            RadixNode4* node4 = (RadixNode4*)node;
+            for (int loop = 0; loop < node4->_count; loop++)
+            {
+                if (node4->_keys[loop] == byte)
+                {
+                    return &node4->_children[loop];
+                }
+            }
+            return NULL;
+        }
+        case RADIX_NODE16:
+        {
+            RadixNode16* node16 = (RadixNode16*)node;
+#if defined(HAVE_X86_SIMD)
+            __m128i keys = _mm_loadu_si128((const __m128i*)node16->_keys);
+            unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(keys, _mm_set1_epi8((char)byte))) & ((1 << node16->_count) - 1);
+            return mask ? &node16->_children[GetLowestBit(mask)] : NULL;
+#else
+            for (int loop = 0; loop < node16->_count; loop++)
+            {
+                if (node16->_keys[loop] == byte)
+                {
+                    return &node16->_children[loop];
+                }
+            }
+            return NULL;
+#endif
+        }
+        case RADIX_NODE48:
+        {
+            RadixNode48* node48 = (RadixNode48*)node;
+            int index = node48->_childIndex[byte];
+            return index ? &node48->_children[index - 1] : NULL;
+        }
+        default:
+        {
+            RadixNode256* node256 = (RadixNode256*)node;
+            return node256->_children[byte] ? &node256->_children[byte] : NULL;
+        }
+        }
+    }
+
+    // Add "ref", the word "word", below "slot", whose first "depth" bytes it shares
+    bool    InsertAt(RadixChild& slot, string_view word, StringRef ref, size_t depth)
+    {
+        if (!slot)
+        {
+            slot = MakeLeaf(ref);
+            return true;
+        }
+
+        if (IsLeaf(slot))
+        {
+            // replace the leaf with a node holding both words, prefixed by what they share
+            string_view existing = GetLeafWord(slot);
+            if (existing == word)
+            {
+                return false;
+            }
+            size_t length = depth;
+            while (GetKeyByte(existing, length) == GetKeyByte(word, length))
+            {
+                length++;
+            }
+            RadixNode4* node = NewNode<RadixNode4>(RADIX_NODE4);
+            SetPrefix(node, word.data() + depth, length - depth);
+            RadixChild nodeSlot = MakeChild(node);
+            AddChild(nodeSlot, GetKeyByte(existing, length), slot);
+            AddChild(nodeSlot, GetKeyByte(word, length), MakeLeaf(ref));
+            slot = nodeSlot;
+            return true;
+        }
+
+        RadixNode* node = GetNode(slot);
+        if (node->_prefixLength)
+        {
+            string_view prefix = GetPrefix(slot, depth);
+            size_t mismatch = 0;
+            while (mismatch < prefix.size() && (unsigned char)prefix[mismatch] == GetKeyByte(word, depth + mismatch))
+            {
+                mismatch++;
+            }
+            if (mismatch < prefix.size())
+            {
+                // split the prefix. A new node takes the part the word shares, and this
+                // node keeps what follows the byte it's now found under
+                string  oldPrefix(prefix);
+                RadixNode4* parent = NewNode<RadixNode4>(RADIX_NODE4);
+                SetPrefix(parent, oldPrefix.data(), mismatch);
+                SetPrefix(node, oldPrefix.data() + mismatch + 1, oldPrefix.size() - mismatch - 1);
+                RadixChild parentSlot = MakeChild(parent);
+                AddChild(parentSlot, (unsigned char)oldPrefix[mismatch], slot);
+                AddChild(parentSlot, GetKeyByte(word, depth + mismatch), MakeLeaf(ref));
+                slot = parentSlot;
+                return true;
+            }
+            depth += prefix.size();
+        }
+
+        unsigned char byte = GetKeyByte(word, depth);
+        RadixChild* child = FindChildSlot(node, byte);
+        if (child)
+        {
+            return InsertAt(*child, word, ref, depth + 1);
+        }
+        AddChild(slot, byte, MakeLeaf(ref));
+        return true;
+    }
+
+    // Add "child" under "byte" to the node at "slot", first moving it to the next
+    // larger kind of node if it's full
+    void    AddChild(RadixChild& slot, unsigned char byte, RadixChild child)
+    {
+        RadixNode* node = GetNode(slot);
+        switch (node->_type)
+        {
+        case RADIX_NODE4:
+        {
+            RadixNode4* node4 = (RadixNode4*)node;
+            if (node4->_count < 4)
+            {
+                AddSortedChild(node4, byte, child);
+                return;
+            }
+            RadixNode16* node16 = NewNode<RadixNode16>(RADIX_NODE16);
+            CopyHeader(node16, node4);
+            memcpy(node16->_keys, node4->_keys, sizeof(node4->_keys));
+            memcpy(node16->_children, node4->_children, sizeof(node4->_children));
+            DeleteNode(node4);
+            AddSortedChild(node16, byte, child);
+            slot = MakeChild(node16);
+            return;
+        }
+        case RADIX_NODE16:
+        {
+            RadixNode16* node16 = (RadixNode16*)node;
+            if (node16->_count < 16)
+            {
+                AddSortedChild(node16, byte, child);
+                return;
+            }
+            RadixNode48* node48 = NewNode<RadixNode48>(RADIX_NODE48);
+            CopyHeader(node48, node16);
+            for (int loop = 0; loop < 16; loop++)
+            {
+                node48->_childIndex[node16->_keys[loop]] = (unsigned char)(loop + 1);
+                node48->_children[loop] = node16->_children[loop];
+            }
+            DeleteNode(node16);
+            node = node48;
+            slot = MakeChild(node48);
+        }
+        // the Node48 has room for the child now
+        [[fallthrough]];
+        case RADIX_NODE48:
+        {
+            RadixNode48* node48 = (RadixNode48*)node;
+            if (node48->_count < 48)
+            {
+                node48->_children[node48->_count] = child;
+                node48->_childIndex[byte] = (unsigned char)(node48->_count + 1);
+                node48->_count++;
+                return;
+            }
+            RadixNode256* node256 = NewNode<RadixNode256>(RADIX_NODE256);
+            CopyHeader(node256, node48);
+            for (int key = 0; key < 256; key++)
+            {
+                if (node48->_childIndex[key])
+                {
+                    node256->_children[key] = node48->_children[node48->_childIndex[key] - 1];
+                }
+            }
+            DeleteNode(node48);
+            node = node256;
+            slot = MakeChild(node256);
+        }
+        [[fallthrough]];
+        default:
+        {
+            RadixNode256* node256 = (RadixNode256*)node;
+            node256->_children[byte] = child;
+            node256->_count++;
+        }
+        }
+    }
+
+    // Add "child" to a Node4 or Node16 with room for it, keeping the keys in order
+    template <class Node>
+    static void AddSortedChild(Node* node, unsigned char byte, RadixChild child)
+    {
+        int position = 0;
+        while (position < node->_count && node->_keys[position] < byte)
+        {
+            position++;
+        }
+        int moved = node->_count - position;
+        memmove(&node->_keys[position + 1], &node->_keys[position], moved);
+        memmove(&node->_children[position + 1], &node->_children[position], moved * sizeof(RadixChild));
+        node->_keys[position] = byte;
+        node->_children[position] = child;
+        node->_count++;
+    }
+
+    static void CopyHeader(RadixNode* to, const RadixNode* from)
+    {
+        to->_count = from->_count;
+        to->_prefixLength = from->_prefixLength;
+        memcpy(to->_prefix, from->_prefix, sizeof(from->_prefix));
+    }
+
+    template <class Node>
+    Node*   NewNode(RadixNodeType type)
+    {
+        Node* node = new Node();
+        node->_type = type;
+        _nodeCounts[type]++;
+        return node;
+    }
+
+    void    DeleteNode(RadixNode* node)
+    {
+        _nodeCounts[node->_type]--;
+        switch (node->_type)
+        {
+        case RADIX_NODE4:
+            delete (RadixNode4*)node;
+            break;
+        case RADIX_NODE16:
+            delete (RadixNode16*)node;
+            break;
+        case RADIX_NODE48:
+            delete (RadixNode48*)node;
+            break;
+        default:
+            delete (RadixNode256*)node;
+            break;
+        }
+    }
+
+    void    DeleteTree(RadixChild child)
+    {
+        if (child && !IsLeaf(child))
+        {
+            auto deleteChild = [this](unsigned char , RadixChild next)
+            {
+                DeleteTree(next);
+                return true;
+            };
+            ForEachChild(GetNode(child), 0, deleteChild);
+            DeleteNode(GetNode(child));
+        }
+    }
+
+    // Call "visitor" with the byte and child of each child of "node" under "firstByte"
+    // or later, in order, until it returns false
+    // return false if it was stopped
+    template <class Visitor>
+    static bool ForEachChild(const RadixNode* node, unsigned char firstByte, Visitor& visitor)
+    {
+        switch (node->_type)
+        {
+        case RADIX_NODE4:
+        case RADIX_NODE16:
+        {
+            const unsigned char* keys = node->_type == RADIX_NODE4 ? ((const RadixNode4*)node)->_keys : ((const RadixNode16*)node)->_keys;
+            const RadixChild* children = node->_type == RADIX_NODE4 ? ((const RadixNode4*)node)->_children : ((const RadixNode16*)node)->_children;
+            for (int loop = 0; loop < node->_count; loop++)
+            {
+                if (keys[loop] >= firstByte && !visitor(keys[loop], children[loop]))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case RADIX_NODE48:
+        {
+            const RadixNode48* node48 = (const RadixNode48*)node;
+            for (int byte = firstByte; byte < 256; byte++)
+            {
+                if (node48->_childIndex[byte] && !visitor((unsigned char)byte, node48->_children[node48->_childIndex[byte] - 1]))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        default:
+        {
+            const RadixNode256* node256 = (const RadixNode256*)node;
+            for (int byte = firstByte; byte < 256; byte++)
+            {
+                if (node256->_children[byte] && !visitor((unsigned char)byte, node256->_children[byte]))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        }
+    }
+
+    // Call "callback" with every word under "child", in order, until it returns false
+    // return false if it was stopped
+    template <class Callback>
+    bool    VisitAll(RadixChild child, Callback& callback) const
+    {
+        if (IsLeaf(child))
+        {
+            return callback(GetLeafWord(child));
+        }
+        auto visitChild = [&](unsigned char , RadixChild next)
+        {
+            return VisitAll(next, callback);
+        };
+        return ForEachChild(GetNode(child), 0, visitChild);
+    }
+
+    // As VisitAll, but skipping the words before "first". The first "depth" bytes of
+    // every word under "child" are the same as those of "first"
+    template <class Callback>
+    bool    VisitFrom(RadixChild child, string_view first, size_t depth, Callback& callback) const
+    {
+        if (IsLeaf(child))
+        {
+            string_view word = GetLeafWord(child);
+            return word < first || callback(word);
+        }
+
+        string_view prefix = GetPrefix(child, depth);
+        for (size_t loop = 0; loop < prefix.size(); loop++)
+        {
+            unsigned char byte = GetKeyByte(first, depth + loop);
+            if ((unsigned char)prefix[loop] != byte)
+            {
+                // the words here are either all before "first" or all after it
+                return (unsigned char)prefix[loop] < byte || VisitAll(child, callback);
+            }
+        }
+        depth += prefix.size();
+
+        unsigned char firstByte = GetKeyByte(first, depth);
+        auto visitChild = [&](unsigned char byte, RadixChild next)
+        {
+            return byte == firstByte ? VisitFrom(next, first, depth + 1, callback) : VisitAll(next, callback);
+        };
+        return ForEachChild(GetNode(child), firstByte, visitChild);
+    }
+
+    RadixChild  _root;
+    size_t      _nodeCounts[NUM_RADIX_NODE_TYPES];
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Filtering out missing words
+//
+// A Bloom filter answers "might this word be in the map" from a few bits, without
+// touching the map, and is never wrong when the answer is no. Put in front of a map,
+// most lookups of missing words stop at the filter.
+// This one is blocked: all of a word's bits are in one 64-byte block, so a check is a
+// single cache miss whatever the number of bits per word. That costs a slightly higher
+// false positive rate than spreading the bits over the whole filter.
+
+static const int   BLOOM_MAX_HASHES = 16;
+
+class BlockedBloomFilter
+{
+public:
+    BlockedBloomFilter()
+        : _numHashes(0)
+    {
+    }
+
+    // Build the filter for "keys", with about "bitsPerKey" bits for each. The number of
+    // bits set per key is the one that gives the fewest false positives for that size
+    void    Build(const vector<HashValue>& keys, double bitsPerKey)
+    {
+        size_t numBits = (size_t)(max<size_t>(keys.size(), 1) * max(bitsPerKey, 1.0));
+        _blocks.assign((numBits + BLOCK_BITS - 1) / BLOCK_BITS, Block());
+        _numHashes = min(max((int)lround(bitsPerKey * log(2.0)), 1), BLOOM_MAX_HASHES);
+        for (size_t loop = 0; loop < keys.size(); loop++)
+        {
+            HashValue hash = Mix64(keys[loop]);
+            Block& block = _blocks[GetBlock(hash)];
+            unsigned long long probe = hash;
+            for (int bit = 0; bit < _numHashes; bit++)
+            {
+                unsigned int position = GetBitPosition(probe, bit);
+                block._words[position / 64] |= 1ull << (position % 64);
+            }
+        }
+    }
+
+    // return false if "key" is definitely not in the filter, true if it might be. A
+    // filter that hasn't been built yet passes everything
+    bool    MayContain(HashValue key) const
+    {
+        if (_blocks.empty())
+            return true;
+
+        HashValue hash = Mix64(key);
+        const Block& block = _blocks[GetBlock(hash)];
+        unsigned long long probe = hash;
+        for (int bit = 0; bit < _numHashes; bit++)
+        {
+            unsigned int position = GetBitPosition(probe, bit);
+            if ((block._words[position / 64] & (1ull << (position % 64))) == 0)
+                return false;
+        }
+        return true;
+    }
+
+    void    Prefetch(HashValue key) const
+    {
+        if (_blocks.empty())
+            return;
+
+        PREFETCH(&_blocks[GetBlock(Mix64(key))]);
+    }
+
+    size_t  GetSizeInBytes() const
+    {
+        return _blocks.size() * sizeof(Block);
+    }
+
+private:
+    static const int    BLOCK_BITS = 512;
+    static const int    BITS_PER_POSITION = 9;      // log2(BLOCK_BITS)
+    static const int    POSITIONS_PER_PROBE = 7;    // bit positions taken from each 64-bit probe
+
+    struct alignas(64) Block
+    {
+        Block()
+        {
+            memset(_words, 0, sizeof(_words));
+        }
+
+        unsigned long long  _words[BLOCK_BITS / 64];
+    };
+
+    // the block is picked by the high bits of the hash
+    size_t  GetBlock(HashValue hash) const
+    {
+        return (size_t)MultiplyHigh(hash, _blocks.size());
+    }
+
+    // Bit positions in the block are taken 9 bits at a time from the top of "probe",
+    // which is remixed whenever its bits run out
+    static unsigned int GetBitPosition(unsigned long long& probe, int bit)
+    {
+        int index = bit % POSITIONS_PER_PROBE;
+        if (index == 0)
+        {
+            probe = (probe ^ (probe >> 32)) * 0x9E3779B97F4A7C15ull;
+        }
+        return (unsigned int)(probe >> (64 - BITS_PER_POSITION * (index + 1))) & (BLOCK_BITS - 1);
+    }
+
+    vector<Block>   _blocks;
+    int             _numHashes;
+};
+
+// A map of type "Map" with a BlockedBloomFilter in front of it. The filter is built
+// from the dictionary when the map is, and Find only goes on to the map if the filter
+// says the word might be there
+template <class Map>
+class FilteredMap : public HashMapBase
+{
+public:
+    FilteredMap(double bitsPerKey)
+        : _bitsPerKey(bitsPerKey)
+    {
+        _name = string("Filtered<") + _map.GetName() + ">(" + to_string((int)bitsPerKey) + " bits/word)";
+    }
+
+    virtual ~FilteredMap()
+    {
+    }
+
+    void    CreateMap(Dictionary* dictionary)
+    {
+        _map.CreateMap(dictionary);
+        INSTRUMENT(_buildMs = _map.GetBuildPhases();)
+
+        INSTRUMENT(StartBuildPhase("filter");)
+        int size = dictionary->GetSize();
+        vector<HashValue>   keys(size);
+        for (int loop = 0; loop < size; loop++)
+        {
+            keys[loop] = _map.GetHash(string(dictionary->GetString(loop)));
+        }
+        _filter.Build(keys, _bitsPerKey);
+        INSTRUMENT(StartBuildPhase(NULL);)
+    }
+
+    const char* GetName() const
+    {
+        return _name.c_str();
+    }
+
+    bool    RefersToDictionaryArena() const
+    {
+        return _map.RefersToDictionaryArena();
+    }
+
+    HashValue   GetHash(const string& word) const
+    {
+        return _map.GetHash(word);
+    }
+
+    bool    Find(const string& wordToFind) const
+    {
+        return FindHashed(_map.GetHash(wordToFind), wordToFind);
+    }
+
+    // only the filter is prefetched, as most missing words will stop there
+    void    Prefetch(HashValue key, const string& ) const
+    {
+        _filter.Prefetch(key);
+    }
+
+    bool    FindHashed(HashValue key, const string& wordToFind) const
+    {
+        if (!_filter.MayContain(key))
+            return false;
+        return _map.FindHashed(key, wordToFind);
+    }
+
+    // return the fraction of "words", none of them in the map, that the filter lets through
+    double  GetFalsePositiveRate(const vector<string>& words) const
+    {
+        int passed = 0;
+        for (size_t loop = 0; loop < words.size(); loop++)
+        {
+            if (_filter.MayContain(_map.GetHash(words[loop])))
+            {
+                passed++;
+            }
+        }
+        return words.empty() ? 0.0 : (double)passed / words.size();
+    }
+
+    size_t  GetFilterSizeInBytes() const
+    {
+        return _filter.GetSizeInBytes();
+    }
 
 private:
-    HashArray       _hashMap[NUM_LETTERS];
+    string              _name;
+    Map                 _map;
+    double              _bitsPerKey;
+    BlockedBloomFilter  _filter;
 };
 
+/////////////////////////////////////////////////////////////////////////////////////////
+// Hash function comparison
+
+static const int        NUM_HASH_PASSES = 20;   // passes over the dictionary to time a hash function
+static volatile HashValue   g_hashSink;         // stops the hashing being optimised away
+
+// Measure the hash function "Hash" on the loaded dictionary: its speed in GB/s, the
+// number of distinct words whose hash is shared with another word, and the speed of
+// Find on a HashMap using it
+template <class Hash>
+static BenchmarkResult RunHashTest(Dictionary* dictionary)
+{
+    int size = dictionary->GetSize();
+
+    size_t bytes = 0;
+    HashValue check = 0;
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    for (int pass = 0; pass < NUM_HASH_PASSES; pass++)
+    {
+        for (int loop = 0; loop < size; loop++)
+        {
+            string_view word = dictionary->GetString(loop);
+            check ^= Hash::Hash(word);
+            bytes += word.size();
+        }
+    }
+    chrono::steady_clock::duration hashTime = chrono::steady_clock::now() - startTime;
+    g_hashSink = check;
+    double gbPerSecond = bytes / chrono::duration<double>(hashTime).count() / 1e9;
+
+    // map each hash to the first word it came from. The words are interned, so equal
+    // offsets are the same word, and each distinct word whose hash was already taken by
+    // another is a collision
+    RobinHoodKeyValueMap<HashValue, unsigned int>   firstWords;
+    RobinHoodKeyValueMap<unsigned int, bool>        seenWords;  // by offset
+    firstWords.Reserve(size);
+    seenWords.Reserve(size);
+    int collisions = 0;
+    for (int loop = 0; loop < size; loop++)
+    {
+        unsigned int offset = dictionary->GetKVPair(loop)._value._offset;
+        if (!seenWords.Insert(offset, true))
+            continue;
+
+        HashValue hash = Hash::Hash(dictionary->GetString(loop));
+        const unsigned int* firstOffset = firstWords.Find(hash);
+        if (firstOffset == NULL)
+        {
+            firstWords.Insert(hash, offset);
+        }
+        else if (*firstOffset != offset)
+        {
+            collisions++;
+        }
+    }
+
+    cout << Hash::GetName() << ": " << gbPerSecond << " GB/s, " << collisions << " collisions" << endl;
+
+    HashMap<Hash> hashMap;
+    hashMap.CreateMap(dictionary);
+    BenchmarkResult result = hashMap.RunTest(dictionary);
+    result._hashGbPerSecond = gbPerSecond;
+    result._hashCollisions = collisions;
+    return result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Key/value lookups
+
+static volatile long long   g_keyValueSink;     // stops the lookups being optimised away
+
+// Time looking up every key of "keys" with "lookup", which returns the key's value or
+// -1, NUM_TRIALS times after NUM_WARMUP_RUNS untimed passes, and set "values" to what
+// was found for each key
+// return the time of the fastest trial in ms
+template <class Lookup>
+static double TimeKeyValueLookups(const vector<HashValue>& keys, Lookup lookup, vector<int>& values)
+{
+    values.resize(keys.size());
+    double bestMs = 0.0;
+    for (int trial = -NUM_WARMUP_RUNS; trial < NUM_TRIALS; trial++)
+    {
+        long long check = 0;
+        chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+        for (size_t loop = 0; loop < keys.size(); loop++)
+        {
+            values[loop] = lookup(keys[loop]);
+            check += values[loop];
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+        g_keyValueSink = check;
+        if (trial >= 0 && (trial == 0 || ms < bestMs))
+        {
+            bestMs = ms;
+        }
+    }
+    return bestMs;
+}
+
+// Map the hash of every dictionary word to the index of the first word with that hash,
+// in a RobinHoodKeyValueMap and in a std::unordered_map, and time looking up the hashes
+// of the workload's queries in each. The values found by the two are compared, so the
+// number of mismatches should be 0
+static void RunKeyValueTest(Dictionary* dictionary)
+{
+    int size = dictionary->GetSize();
+    RobinHoodKeyValueMap<HashValue, int>    robinHoodMap;
+    unordered_map<HashValue, int>           unorderedMap;
+    robinHoodMap.Reserve(size);
+    unorderedMap.reserve(size);
+    for (int loop = 0; loop < size; loop++)
+    {
+        HashValue hash = StringHashPolicy::Hash(dictionary->GetString(loop));
+        robinHoodMap.Insert(hash, loop);
+        unorderedMap.emplace(hash, loop);
+    }
+
+    vector<string>  words;
+    GenerateQueries(dictionary, g_defaultWorkload, words);
+    vector<HashValue>   keys(words.size());
+    for (size_t loop = 0; loop < words.size(); loop++)
+    {
+        keys[loop] = StringHashPolicy::Hash(words[loop]);
+    }
+
+    vector<int> robinHoodValues;
+    double robinHoodMs = TimeKeyValueLookups(keys, [&robinHoodMap](HashValue key)
+    {
+        const int* value = robinHoodMap.Find(key);
+        return value != NULL ? *value : -1;
+    }, robinHoodValues);
+
+    vector<int> unorderedValues;
+    double unorderedMs = TimeKeyValueLookups(keys, [&unorderedMap](HashValue key)
+    {
+        unordered_map<HashValue, int>::const_iterator it = unorderedMap.find(key);
+        return it != unorderedMap.end() ? it->second : -1;
+    }, unorderedValues);
+
+    int mismatches = 0;
+    for (size_t loop = 0; loop < keys.size(); loop++)
+    {
+        if (robinHoodValues[loop] != unorderedValues[loop])
+        {
+            mismatches++;
+        }
+    }
+    cout << keys.size() << " word indices looked up by hash: RobinHoodKeyValueMap " << robinHoodMs << "ms, unordered_map "
+         << unorderedMs << "ms, " << mismatches << " mismatches" << endl;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Filter comparison
+
+// Time hits and misses on "map" without a filter and then with a "bitsPerKey" filter in
+// front of it, adding both results to "results". "map" is deleted
+template <class Map>
+static void RunFilterTest(Dictionary* dictionary, double bitsPerKey, vector<BenchmarkResult>& results)
+{
+    BenchmarkResult unfiltered;
+    {
+        StaticDispatch<Map> map;
+        map.CreateMap(dictionary);
+        cout << "Running " << map.GetName() << endl;
+        unfiltered = map.RunTest(dictionary);
+        map.RunMissTest(dictionary, unfiltered);
+        results.push_back(unfiltered);
+    }
+
+    StaticDispatch< FilteredMap<Map> > filtered(bitsPerKey);
+    filtered.CreateMap(dictionary);
+    cout << "Running " << filtered.GetName() << endl;
+    BenchmarkResult result = filtered.RunTest(dictionary);
+    filtered.RunMissTest(dictionary, result);
+
+    vector<string>  missingWords;
+    HashMapBase::GetMissingWords(dictionary, missingWords);
+    result._falsePositiveRate = filtered.GetFalsePositiveRate(missingWords);
+    double unfilteredHitMs = *min_element(unfiltered._trialMs.begin(), unfiltered._trialMs.end());
+    double hitMs = *min_element(result._trialMs.begin(), result._trialMs.end());
+    cout << "  filter of " << filtered.GetFilterSizeInBytes() / 1024 << "KB: " << result._falsePositiveRate * 100.0 << "% false positives"
+         << ", misses " << unfiltered._missMs / result._missMs << "x faster"
+         << ", hits " << unfilteredHitMs / hitMs << "x faster" << endl;
+    results.push_back(result);
+}
+
+// Compare a few maps with and without a filter in front of them
+static void RunFilterTests(Dictionary* dictionary, double bitsPerKey, vector<BenchmarkResult>& results)
+{
+    RunFilterTest< ShardedMonolithicMap<> >(dictionary, bitsPerKey, results);
+    RunFilterTest< HashMap<> >(dictionary, bitsPerKey, results);
+    RunFilterTest< RobinHoodMap<> >(dictionary, bitsPerKey, results);
+    RunFilterTest< SwissMap<> >(dictionary, bitsPerKey, results);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Bucket sizing tuning
+
+static const int    TUNING_WORDS_PER_BUCKET[] = { 1, 2, 4, 8, 16 };    // HashMap load factors tried
+
+// Time a HashMap sized with "Sizing" at each of TUNING_WORDS_PER_BUCKET
+template <class Sizing>
+static void TuneSizing(Dictionary* dictionary, vector<BenchmarkResult>& results)
+{
+    for (size_t loop = 0; loop < sizeof(TUNING_WORDS_PER_BUCKET) / sizeof(TUNING_WORDS_PER_BUCKET[0]); loop++)
+    {
+        StaticDispatch< HashMap<StringHashPolicy, Sizing> > hashMap(TUNING_WORDS_PER_BUCKET[loop]);
+        hashMap.CreateMap(dictionary);
+        cout << "Running " << hashMap.GetName() << endl;
+        results.push_back(hashMap.RunTest(dictionary));
+    }
+}
+
+// Time HashMap with every sizing policy and load factor on the loaded dictionary,
+// adding the results to "results", and report the fastest
+static void RunTuning(Dictionary* dictionary, vector<BenchmarkResult>& results)
+{
+    size_t first = results.size();
+    TuneSizing<PrimeSizingPolicy>(dictionary, results);
+    TuneSizing<PowerOfTwoSizingPolicy>(dictionary, results);
+    TuneSizing<LemireSizingPolicy>(dictionary, results);
+
+    size_t fastest = first;
+    double fastestMs = 0.0;
+    for (size_t loop = first; loop < results.size(); loop++)
+    {
+        double bestMs = *min_element(results[loop]._trialMs.begin(), results[loop]._trialMs.end());
+        if (loop == first || bestMs < fastestMs)
+        {
+            fastest = loop;
+            fastestMs = bestMs;
+        }
+    }
+    cout << "Fastest: " << results[fastest]._name << " at " << fastestMs << "ms" << endl;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Online growth
+
+static const int    NUM_INSERTS = 1000000;  // new words inserted by RunInsertTest
+
+// Time inserting NUM_INSERTS new words into a HashMap built from the dictionary, one at
+// a time, so that every shard's table has to grow several times. The tables grow a
+// few buckets per Insert, so the tail latency should stay close to the median
+static void RunInsertTest(Dictionary* dictionary)
+{
+    HashMap<> hashMap;
+    hashMap.CreateMap(dictionary);
+
+    int size = dictionary->GetSize();
+    vector<string>  words(NUM_INSERTS);
+    for (int loop = 0; loop < NUM_INSERTS; loop++)
+    {
+        words[loop] = string(dictionary->GetString(loop % size)) + "-" + to_string(loop / size);
+    }
+
+    LatencyHistogram    latency;
+    int inserted = 0;
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    for (int loop = 0; loop < NUM_INSERTS; loop++)
+    {
+        unsigned long long start = ReadTicks();
+        if (hashMap.Insert(words[loop]))
+        {
+            inserted++;
+        }
+        latency.Record(ReadTicks() - start);
+    }
+    chrono::steady_clock::duration insertTime = chrono::steady_clock::now() - startTime;
+
+    double nsPerTick = GetNanosecondsPerTick();
+    cout << chrono::duration<double, milli>(insertTime).count() << "ms to insert " << inserted << " words"
+         << (hashMap.IsGrowing() ? " (still growing)" : "")
+         << " p50 " << latency.GetPercentile(50.0) * nsPerTick << "ns"
+         << " p99 " << latency.GetPercentile(99.0) * nsPerTick << "ns"
+         << " p99.9 " << latency.GetPercentile(99.9) * nsPerTick << "ns"
+         << " max " << latency.GetMax() * nsPerTick << "ns" << endl;
+}
+
+// Erase every word of the dictionary from a "Map" built from it with CreateMap, then
+// insert them all again and erase them a second time, checking Find misses every word
+// after each pass. The first pass erases words the map doesn't own, the second words in
+// its own arena. Compaction is allowed after any erased bytes, so it is tried on every
+// erase whatever the size of the dictionary
+// return true if no word was found after either pass
+template <class Map>
+static bool CheckEraseAll(Dictionary* dictionary)
+{
+    Map map;
+    map.SetArenaSizes(0, 0);
+    map.CreateMap(dictionary);
+
+    int size = dictionary->GetSize();
+    int found = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass > 0)
+        {
+            for (int loop = 0; loop < size; loop++)
+            {
+                map.Insert(string(dictionary->GetString(loop)));
+            }
+        }
+        for (int loop = 0; loop < size; loop++)
+        {
+            map.Erase(string(dictionary->GetString(loop)));
+        }
+        for (int loop = 0; loop < size; loop++)
+        {
+            if (map.Find(string(dictionary->GetString(loop))))
+            {
+                found++;
+            }
+        }
+    }
+
+    cout << "Erasing the dictionary from " << map.GetName() << ": ";
+    if (found > 0)
+    {
+        cout << found << " words still found" << endl;
+        return false;
+    }
+    cout << "ok" << endl;
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Mixed reads and writes
+
+static const int    NUM_MIXED_OPERATIONS = 1000000;     // operations per run, split over the threads
+static const int    NUM_NEW_WORDS = 1024;               // words each thread inserts and erases
+static const int    WRITE_PERCENTS[] = { 5, 50 };       // percentage of operations that write
+
+// Time "map" with "numThreads" threads each making their share of NUM_MIXED_OPERATIONS
+// operations, "writePercent"% of them writes, alternately inserting and erasing words
+// only that thread uses, and the rest Finds of dictionary words. Prints the total
+// operations per second and the latency of all operations
+template <class Map>
+static void RunMixedOperations(Map& map, const vector<string>& words, int numThreads, int writePercent)
+{
+    int size = words.size();
+    int operationsPerThread = NUM_MIXED_OPERATIONS / numThreads;
+    vector<ThreadResult>    threadResults(numThreads);
+    StartGate               startGate(numThreads);
+    vector<thread>          threads;
+    for (int threadIndex = 0; threadIndex < numThreads; threadIndex++)
+    {
+        threads.push_back(thread([&, threadIndex]()
+        {
+            PinThreadToCpu(threadIndex);
+            ThreadResult& threadResult = threadResults[threadIndex];
+            vector<string>  newWords(NUM_NEW_WORDS);
+            for (int loop = 0; loop < NUM_NEW_WORDS; loop++)
+            {
+                newWords[loop] = words[(loop * 97 + threadIndex) % size] + "-" + to_string(threadIndex);
+            }
+
+            unsigned long long random = 0x9E3779B97F4A7C15ull * (threadIndex + 1);
+            int index = (int)((long long)size * threadIndex / numThreads);
+            int numWrites = 0;
+            startGate.Wait();
+            threadResult._startTime = chrono::steady_clock::now();
+            for (int loop = 0; loop < operationsPerThread; loop++)
+            {
+                random ^= random << 13;
+                random ^= random >> 7;
+                random ^= random << 17;
+                unsigned long long start = ReadTicks();
+                if ((int)(random % 100) < writePercent)
+                {
+                    const string& word = newWords[(numWrites / 2) % NUM_NEW_WORDS];
+                    if (numWrites % 2 == 0)
+                    {
+                        map.Insert(word);
+                    }
+                    else
+                    {
+                        map.Erase(word);
+                    }
+                    numWrites++;
+                }
+                else
+                {
+                    if (map.Map::Find(words[index]))
+                    {
+                        threadResult._found++;
+                    }
+                    index = (index + 1) % size;
+                }
+                threadResult._latency.Record(ReadTicks() - start);
+            }
+            threadResult._endTime = chrono::steady_clock::now();
+        }));
+    }
+    for (int threadIndex = 0; threadIndex < numThreads; threadIndex++)
+    {
+        threads[threadIndex].join();
+    }
+
+    chrono::steady_clock::time_point startTime = threadResults[0]._startTime;
+    chrono::steady_clock::time_point endTime = threadResults[0]._endTime;
+    LatencyHistogram    latency;
+    for (int threadIndex = 0; threadIndex < numThreads; threadIndex++)
+    {
+        startTime = min(startTime, threadResults[threadIndex]._startTime);
+        endTime = max(endTime, threadResults[threadIndex]._endTime);
+        latency.Merge(threadResults[threadIndex]._latency);
+    }
+    double seconds = chrono::duration<double>(endTime - startTime).count();
+    double nsPerTick = GetNanosecondsPerTick();
+    cout << "  " << 100 - writePercent << "/" << writePercent << " reads/writes, " << numThreads << " threads: "
+         << (double)operationsPerThread * numThreads / seconds / 1e6 << "M operations/s"
+         << ", p50 " << latency.GetPercentile(50.0) * nsPerTick << "ns"
+         << " p99 " << latency.GetPercentile(99.0) * nsPerTick << "ns" << endl;
+}
+
+// Time ConcurrentHashMap with each mix of reads and writes in WRITE_PERCENTS, on 1,
+// 2, 4... threads up to the number of CPUs available. A map with a single shard, the
+// same as one lock around the whole map, is timed too for comparison
+static void RunMixedTest(Dictionary* dictionary)
+{
+    vector<string>  words(dictionary->GetSize());
+    for (size_t loop = 0; loop < words.size(); loop++)
+    {
+        words[loop] = dictionary->GetString(loop);
+    }
+    int maxThreads = GetAvailableCpus().size();
+
+    static const int shardCounts[] = { 64, 1 };
+    for (size_t shardIndex = 0; shardIndex < sizeof(shardCounts) / sizeof(shardCounts[0]); shardIndex++)
+    {
+        ConcurrentHashMap<> map(shardCounts[shardIndex]);
+        map.CreateMap(dictionary);
+        cout << map.GetName() << ", arenas hold " << map.GetArenaSize() << " bytes" << endl;
+        for (size_t writeIndex = 0; writeIndex < sizeof(WRITE_PERCENTS) / sizeof(WRITE_PERCENTS[0]); writeIndex++)
+        {
+            for (int numThreads = 1; ; numThreads = min(numThreads * 2, maxThreads))
+            {
+                RunMixedOperations(map, words, numThreads, WRITE_PERCENTS[writeIndex]);
+                if (numThreads == maxThreads)
+                    break;
+            }
+            cout << "  arenas hold " << map.GetArenaSize() << " bytes" << endl;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Prefix queries
+//
+// The hash maps can't find the words starting with a prefix, so without the radix tree
+// the only way is to scan every word in the dictionary.
+
+static const int    NUM_PREFIX_QUERIES = 1000;  // prefixes looked up per run
+static const int    NUM_COMPLETIONS = 10;       // words wanted per prefix for autocomplete
+
+// Time finding every word starting with each of NUM_PREFIX_QUERIES prefixes of 1 to 4
+// letters, taken from random dictionary words, with RadixTreeMap::FindPrefix and with a
+// scan of the dictionary. Also times taking just the first NUM_COMPLETIONS words for
+// each in order, as autocomplete would
+static void RunPrefixTest(Dictionary* dictionary)
+{
+    RadixTreeMap radixTree;
+    radixTree.CreateMap(dictionary);
+
+    int size = dictionary->GetSize();
+    WorkloadRandom  random(g_defaultWorkload._seed);
+    vector<string>  prefixes(NUM_PREFIX_QUERIES);
+    for (int loop = 0; loop < NUM_PREFIX_QUERIES; loop++)
+    {
+        string_view word = dictionary->GetString((int)random.NextIndex(size));
+        prefixes[loop] = string(word.substr(0, 1 + random.NextIndex(4)));
+    }
+
+    long long treeWords = 0;
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    for (int loop = 0; loop < NUM_PREFIX_QUERIES; loop++)
+    {
+        treeWords += radixTree.FindPrefix(prefixes[loop], [](string_view ) {});
+    }
+    double treeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+
+    long long scanWords = 0;
+    startTime = chrono::steady_clock::now();
+    for (int loop = 0; loop < NUM_PREFIX_QUERIES; loop++)
+    {
+        string_view prefix = prefixes[loop];
+        for (int index = 0; index < size; index++)
+        {
+            if (dictionary->GetString(index).substr(0, prefix.size()) == prefix)
+            {
+                scanWords++;
+            }
+        }
+    }
+    double scanMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+
+    long long completions = 0;
+    startTime = chrono::steady_clock::now();
+    for (int loop = 0; loop < NUM_PREFIX_QUERIES; loop++)
+    {
+        string_view prefix = prefixes[loop];
+        int count = 0;
+        radixTree.Scan(prefix, [&](string_view word)
+        {
+            if (word.substr(0, prefix.size()) != prefix)
+            {
+                return false;
+            }
+            completions++;
+            return ++count < NUM_COMPLETIONS;
+        });
+    }
+    double completionMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+
+    cout << NUM_PREFIX_QUERIES << " prefixes: " << treeMs << "ms for " << treeWords << " words with the radix tree, "
+         << scanMs << "ms for " << scanWords << " words scanning the dictionary (" << scanMs / treeMs << "x)" << endl;
+    cout << "  first " << NUM_COMPLETIONS << " words of each: " << completionMs << "ms for " << completions << " words" << endl;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////
 // The main test program here
+//
+// Look up "words" in the index "indexFileName" built from the word list "wordListFileName".
+// If the index is up to date it is mapped and used straight away, without reading the
+// word list; if not, the word list is read and the index rebuilt first. Prints the time
+// until the first lookup could be made, then whether each word was found
+static int FindInIndex(const char* indexFileName, const char* wordListFileName, const vector<string>& words)
+{
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    MappedIndexMap<> index(indexFileName, wordListFileName);
+    if (!index.Open())
+    {
+        cout << "Index " << indexFileName << " is missing or older than " << wordListFileName << ", building it" << endl;
+        Dictionary dictionary;
+        if (!dictionary.MapFile(wordListFileName))
+        {
+            cout << "Unable to read " << wordListFileName << endl;
+            return 1;
+        }
+        index.CreateMap(&dictionary);
+    }
+    chrono::steady_clock::duration readyTime = chrono::steady_clock::now() - startTime;
+    cout << "Ready in " << chrono::duration<double, milli>(readyTime).count() << "ms" << endl;
+
+    for (size_t loop = 0; loop < words.size(); loop++)
+    {
+        cout << words[loop] << (index.Find(words[loop]) ? " found" : " not found") << endl;
+    }
+    return 0;
+}
+
+// usage: DictionaryHashMap [-mmap] [-batch] [-threads] [-mixed] [-prefix] [-hashes] [-filter bits] [-tune] [-insert] [-keyvalue]
+//                          [-workload sequential|shuffled|uniform|zipf] [-zipf s] [-misses fraction] [-seed n] [-index wordlist.idx] [-csv results.csv] [-json results.json]
+//        DictionaryHashMap [-index wordlist.idx] -find word...
+//
+// -find looks the words up in the index alone, only reading wordlist.txt if the index
+// has to be built
+//
+// Build with -DINSTRUMENT_MAPS to add probe counts, build phase times and hardware counters to the results,
+// and with -DCOUNT_ALLOCATIONS to add the heap each map uses
 int main(int argc, char**argv)
 {
+    const char* csvFileName = NULL;
+    const char* jsonFileName = NULL;
+    bool batchTest = false;
+    bool mapDictionary = false;
+    bool hashTest = false;
+    bool insertTest = false;
+    bool keyValueTest = false;
+    bool threadTest = false;
+    bool mixedTest = false;
+    bool prefixTest = false;
+    bool tune = false;
+    double filterBitsPerKey = 0.0;
+    const char* indexFileName = "wordlist.idx";
+    const char* wordListFileName = "wordlist.txt";
+    vector<string> findWords;
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if (strcmp(argv[arg], "-csv") == 0 && arg + 1 < argc)
+        {
+            csvFileName = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "-json") == 0 && arg + 1 < argc)
+        {
+            jsonFileName = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "-batch") == 0)
+        {
+            batchTest = true;
+        }
+        else if (strcmp(argv[arg], "-mmap") == 0)
+        {
+            mapDictionary = true;
+        }
+        else if (strcmp(argv[arg], "-hashes") == 0)
+        {
+            hashTest = true;
+        }
+        else if (strcmp(argv[arg], "-threads") == 0)
+        {
+            threadTest = true;
+        }
+        else if (strcmp(argv[arg], "-mixed") == 0)
+        {
+            mixedTest = true;
+        }
+        else if (strcmp(argv[arg], "-prefix") == 0)
+        {
+            prefixTest = true;
+        }
+        else if (strcmp(argv[arg], "-filter") == 0 && arg + 1 < argc)
+        {
+            filterBitsPerKey = atof(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "-workload") == 0 && arg + 1 < argc)
+        {
+            if (!g_defaultWorkload.SetOrder(argv[++arg]))
+            {
+                cout << "Unknown workload " << argv[arg] << endl;
+                return 1;
+            }
+        }
+        else if (strcmp(argv[arg], "-zipf") == 0 && arg + 1 < argc)
+        {
+            g_defaultWorkload._order = WORKLOAD_ZIPF;
+            g_defaultWorkload._zipfExponent = atof(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "-misses") == 0 && arg + 1 < argc)
+        {
+            g_defaultWorkload._missFraction = min(max(atof(argv[++arg]), 0.0), 1.0);
+        }
+        else if (strcmp(argv[arg], "-seed") == 0 && arg + 1 < argc)
+        {
+            g_defaultWorkload._seed = strtoull(argv[++arg], NULL, 10);
+        }
+        else if (strcmp(argv[arg], "-tune") == 0)
+        {
+            tune = true;
+        }
+        else if (strcmp(argv[arg], "-insert") == 0)
+        {
+            insertTest = true;
+        }
+        else if (strcmp(argv[arg], "-keyvalue") == 0)
+        {
+            keyValueTest = true;
+        }
+        else if (strcmp(argv[arg], "-index") == 0 && arg + 1 < argc)
+        {
+            indexFileName = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "-find") == 0)
+        {
+            findWords.assign(argv + arg + 1, argv + argc);
+            break;
+        }
+    }
+
+    if (!findWords.empty())
+    {
+        return FindInIndex(indexFileName, wordListFileName, findWords);
+    }
+
     Dictionary* dictionary = new Dictionary();
     HashMapBase* testMap[NUM_TEST_CLASSES];
 
-    testMap[0] = new MonolithicMap();
-    testMap[1] = new MonolithicLetterMap();
-    testMap[2] = new HashMap;
+    testMap[0] = new StaticDispatch< MonolithicMap<> >();
+    testMap[1] = new StaticDispatch< ShardedMonolithicMap<> >();
+    testMap[2] = new StaticDispatch< HashMap<> >();
+    testMap[3] = new StaticDispatch< RobinHoodMap<> >();
+    testMap[4] = new StaticDispatch< SwissMap<> >();
+    testMap[5] = new StaticDispatch< PerfectHashMap<> >();
+    testMap[6] = new StaticDispatch< MappedIndexMap<> >(indexFileName, wordListFileName);
+    testMap[7] = new StaticDispatch< ConcurrentHashMap<> >();
+    testMap[8] = new StaticDispatch< RadixTreeMap >();
+    testMap[9] = new StaticDispatch< EytzingerMap<> >();
+    testMap[10] = new StaticDispatch< RobinHoodMap<StringHashPolicy, InlineWordStorage<> > >();
+    testMap[11] = new StaticDispatch< SwissMap<StringHashPolicy, InlineWordStorage<> > >();
 
     cout << "Reading Dictionary" << endl;
-    if (dictionary->ReadFile("wordlist.txt"))
+    MemoryUsage beforeRead = MemoryUsage::Get();
+    chrono::steady_clock::time_point readStart = chrono::steady_clock::now();
+    bool dictionaryRead = mapDictionary ? dictionary->MapFile(wordListFileName) : dictionary->ReadFile(wordListFileName);
+    chrono::steady_clock::duration readTime = chrono::steady_clock::now() - readStart;
+    MemoryUsage afterRead = MemoryUsage::Get();
+    if (dictionaryRead && dictionary->GetSize() == 0)
     {
+        // the queries for every test are drawn from the dictionary's words
+        cout << "No words in " << wordListFileName << endl;
+    }
+    else if (dictionaryRead)
+    {
+        cout << "Read " << dictionary->GetSize() << " words in " << chrono::duration<double, milli>(readTime).count() << "ms";
+        if (afterRead._heapBytes >= 0)
+        {
+            cout << ", " << (double)(afterRead._heapBytes - beforeRead._heapBytes) / max(dictionary->GetSize(), 1) << " bytes/word on the heap";
+        }
+        cout << endl;
+        int numArenaMaps = 0;
+        for (int loop = 0; loop < NUM_TEST_CLASSES; loop++)
+        {
+            if (testMap[loop]->RefersToDictionaryArena())
+            {
+                numArenaMaps++;
+            }
+        }
+        ReportStringMemory(dictionary, numArenaMaps);
+        cout << "Workload: " << g_defaultWorkload.GetName() << endl;
+
+        vector<BenchmarkResult> results;
         for (int loop = 0; loop < NUM_TEST_CLASSES; loop++)
         {
             cout << "Creating Map " << loop << endl;
+            ResetHeapPeak();
+            MemoryUsage beforeCreate = MemoryUsage::Get();
             testMap[loop]->CreateMap(dictionary);
-            cout << "Running test " << loop << endl;
-            testMap[loop]->RunTest(dictionary);
+            MemoryUsage afterCreate = MemoryUsage::Get();
+            cout << "Running test " << loop << " (" << testMap[loop]->GetName() << ")" << endl;
+            results.push_back(testMap[loop]->RunTest(dictionary));
+            RecordMapMemory(beforeCreate, afterCreate, dictionary->GetSize(), results.back());
+            if (batchTest)
+            {
+                testMap[loop]->RunBatchTest(dictionary, results.back());
+            }
+            if (threadTest)
+            {
+                testMap[loop]->RunThreadedTest(dictionary, results.back());
+            }
             cout << "Deleting " << loop << endl;
+            chrono::steady_clock::time_point deleteStart = chrono::steady_clock::now();
             delete testMap[loop];
+            results.back()._deleteMs = chrono::duration<double, milli>(chrono::steady_clock::now() - deleteStart).count();
+            cout << "Deleted in " << results.back()._deleteMs << "ms" << endl;
+        }
+
+        if (hashTest)
+        {
+            cout << "Comparing hash functions" << endl;
+            results.push_back(RunHashTest<StringHashPolicy>(dictionary));
+            results.push_back(RunHashTest<Fnv1aHashPolicy>(dictionary));
+            results.push_back(RunHashTest<WyHashPolicy>(dictionary));
+            results.push_back(RunHashTest<Crc32cHashPolicy>(dictionary));
+        }
+
+        if (keyValueTest)
+        {
+            cout << "Key/value lookups" << endl;
+            RunKeyValueTest(dictionary);
+        }
+
+        if (filterBitsPerKey > 0.0)
+        {
+            cout << "Comparing maps with a " << filterBitsPerKey << " bits/word filter" << endl;
+            RunFilterTests(dictionary, filterBitsPerKey, results);
+        }
+
+        if (tune)
+        {
+            cout << "Tuning HashMap bucket sizing" << endl;
+            RunTuning(dictionary, results);
+        }
+
+        if (insertTest)
+        {
+            cout << "Growing HashMap" << endl;
+            CheckEraseAll< HashMap<> >(dictionary);
+            CheckEraseAll< RobinHoodMap<> >(dictionary);
+            RunInsertTest(dictionary);
+        }
+
+        if (mixedTest)
+        {
+            cout << "Mixed reads and writes" << endl;
+            RunMixedTest(dictionary);
+        }
+
+        if (prefixTest)
+        {
+            cout << "Prefix queries" << endl;
+            RunPrefixTest(dictionary);
+        }
+
+        if (csvFileName)
+        {
+            ofstream csvFile(csvFileName);
+            WriteResultsCsv(csvFile, results);
+        }
+        if (jsonFileName)
+        {
+            ofstream jsonFile(jsonFileName);
+            WriteResultsJson(jsonFile, results);
         }
     }
     delete dictionary;